@@ -0,0 +1,186 @@
+// Times the frame pipeline on the null backend: committing batches, then commenceWork() through to the
+// frame being submitted, for each sort type and a few submission thread counts. Commands are only
+// counted, not recorded, so the numbers are the renderer's own CPU cost.
+//
+// Usage: RenderBench [batches per frame] [frames]
+
+#include "render/BatchQueue.h"
+#include "render/RenderPlan.h"
+#include "render/null/RendererNull.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+
+using namespace eigen;
+
+namespace
+{
+    typedef std::chrono::steady_clock Clock;
+
+    class BenchBatch : public RenderBatch
+    {
+    public:
+
+        BenchBatch(unsigned seed)
+        {
+            _stateIds[PerformanceKeyLayout::Effect]             = seed % 61;
+            _stateIds[PerformanceKeyLayout::Aspects]            = seed % 5;
+            _stateIds[PerformanceKeyLayout::Data]               = seed % 1021;
+            _stateIds[PerformanceKeyLayout::ParameterBlocks]    = seed;
+        }
+    };
+
+    struct Timing
+    {
+        double      commitMs;
+        double      submitMs;
+    };
+
+    double Milliseconds(Clock::time_point start, Clock::time_point end)
+    {
+        return std::chrono::duration<double, std::milli>(end - start).count();
+    }
+
+    // Batches aren't destroyed, RenderBatch can't be from outside
+
+    bool Measure(Timing& timing, BatchStage::SortType sortType, unsigned submissionThreads, unsigned frames,
+                 RenderBatch* const* batches, const float* depths, unsigned batchCount)
+    {
+        Renderer::PlatformConfig platformConfig;
+        platformConfig.commandCapacity = 0;
+
+        Renderer::Config config;
+        config.scratchSize = 64*1024*1024;
+        config.submissionThreads = submissionThreads;
+        config.platformConfig = &platformConfig;
+
+        Renderer renderer;
+        Error error = renderer.initialize(config);
+        if (Failed(error))
+        {
+            printf("%s\n", error.getText());
+            return false;
+        }
+
+        bool ok = true;
+        timing = {};
+        {
+            const RenderBin* bin = renderer.getBin("bench");
+
+            DisplayPtr display = renderer.createDisplay();
+            display.ptr->bindToWindow((void*)1);
+
+            TargetSetPtr targets = renderer.createTargetSet();
+            TargetSet::Config targetsConfig;
+            targetsConfig.textures[0] = display.ptr->getTarget();
+            targets.ptr->initialize(targetsConfig);
+
+            RenderPlanPtr plan = renderer.createPlan();
+            plan.ptr->addClearStage(targets.ptr);
+            BatchStage& stage = plan.ptr->addBatchStage(targets.ptr);
+            stage.sortType = sortType;
+            stage.attachBin(bin);
+
+            error = plan.ptr->validate();
+            ok = !Failed(error);
+
+            // One untimed frame to warm up scratch memory and the threads
+
+            for (unsigned f = 0; ok && f <= frames; f++)
+            {
+                Clock::time_point start = Clock::now();
+
+                BatchQueue* batchQ = renderer.openBatchQueue(plan.ptr);
+                if (!batchQ)
+                {
+                    ok = false;
+                    break;
+                }
+                for (unsigned i = 0; i < batchCount; i++)
+                {
+                    batchQ->commitBatch(batches[i], bin, depths[i]);
+                }
+                batchQ->finish();
+
+                Clock::time_point committed = Clock::now();
+
+                error = renderer.commenceWork();
+                renderer.waitForFrame(renderer.getFrameNumber() - 1);
+
+                Clock::time_point submitted = Clock::now();
+
+                ok = !Failed(error);
+                if (f > 0)
+                {
+                    timing.commitMs += Milliseconds(start, committed) / frames;
+                    timing.submitMs += Milliseconds(committed, submitted) / frames;
+                }
+            }
+
+            if (!ok)
+            {
+                printf("%s\n", Failed(error) ? error.getText() : "out of scratch memory");
+            }
+        }
+
+        renderer.cleanup();
+        return ok;
+    }
+}
+
+int main(int argc, char** argv)
+{
+    unsigned batchCount = argc > 1 ? (unsigned)atoi(argv[1]) : 100000;
+    unsigned frames = argc > 2 ? (unsigned)atoi(argv[2]) : 20;
+    if (!batchCount || !frames)
+    {
+        puts("Usage: RenderBench [batches per frame] [frames]");
+        return 1;
+    }
+
+    auto batchMemory = (BenchBatch*)malloc(batchCount * sizeof(BenchBatch));
+    auto batches = (RenderBatch**)malloc(batchCount * sizeof(RenderBatch*));
+    auto depths = (float*)malloc(batchCount * sizeof(float));
+
+    srand(1);
+    for (unsigned i = 0; i < batchCount; i++)
+    {
+        batches[i] = new (batchMemory + i) BenchBatch(rand());
+        depths[i] = rand() / (float)RAND_MAX;
+    }
+
+    const struct { BatchStage::SortType type; const char* name; } sortTypes[] =
+    {
+        {BatchStage::SortType::Performance,                 "Performance"},
+        {BatchStage::SortType::IncreasingDepth,             "IncreasingDepth"},
+        {BatchStage::SortType::DecreasingDepth,             "DecreasingDepth"},
+        {BatchStage::SortType::DepthBucketedPerformance,    "DepthBucketedPerformance"},
+        {BatchStage::SortType::IncreasingDepthBuckets,      "IncreasingDepthBuckets"},
+        {BatchStage::SortType::DecreasingDepthBuckets,      "DecreasingDepthBuckets"},
+    };
+    const unsigned threadCounts[] = {1, 2, 4};
+
+    printf("%u batches, mean of %u frames\n\n", batchCount, frames);
+    printf("%-26s %7s %11s %11s\n", "sort", "threads", "commit ms", "submit ms");
+
+    int result = 0;
+    for (auto& sortType : sortTypes)
+    {
+        for (unsigned threads : threadCounts)
+        {
+            Timing timing;
+            if (!Measure(timing, sortType.type, threads, frames, batches, depths, batchCount))
+            {
+                result = 1;
+                continue;
+            }
+            printf("%-26s %7u %11.3f %11.3f\n", sortType.name, threads, timing.commitMs, timing.submitMs);
+        }
+    }
+
+    free(depths);
+    free(batches);
+    free(batchMemory);
+    return result;
+}
@@ -1,6 +1,8 @@
 #pragma once
 
 #include <cstdint>
+#include <cassert>
+#include "math.h"
 
 namespace eigen
 {
@@ -23,6 +25,7 @@ namespace eigen
         bool        isEmpty() const;
         bool        isSubsetOf(const BitSet& set) const;
         bool        intersects(const BitSet& set) const;
+        bool        test(unsigned position) const;
 
         void        clear();
         void        set(unsigned position, bool value);
@@ -139,6 +142,13 @@ namespace eigen
         return false;
     }
 
+    template<int N> bool BitSet<N>::test(unsigned position) const
+    {
+        unsigned i = position / PartSize;
+        position -= i*PartSize;
+        return ((_parts[i] >> position) & 1) != 0;
+    }
+
     template<int N> void BitSet<N>::clear()
     {
         for (unsigned i = 0; i < Parts; i++)
@@ -1,6 +1,10 @@
 #include "Error.h"
 #include <cstdio>
 
+#ifndef _MSC_VER
+#define _snprintf_s snprintf
+#endif
+
 namespace eigen
 {
     ErrorMsg::ErrorMsg(const char* fmt, long arg)
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "memory.h"
+#include <algorithm>
 
 namespace eigen
 {
@@ -52,7 +53,7 @@ namespace eigen
 
     template<typename T> PodArray<T>::PodArray(Allocator* allocator, unsigned initialCapacity)
     {
-        initialize(allcoator, initialCapacity);
+        initialize(allocator, initialCapacity);
     }
 
     template<typename T> PodArray<T>::PodArray()
@@ -120,7 +121,7 @@ namespace eigen
                 capacity = std::max(capacity, _capacity*2);
             }
             T* elements = AllocateMemory<T>(Allocation::From(_elements)->_allocator, capacity);
-            memcpy(elements, _elements, _count);
+            memcpy(elements, _elements, sizeof(T)*_count);
             FreeMemory(_elements);
             _elements = elements;
             _capacity = capacity;
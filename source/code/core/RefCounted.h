@@ -5,6 +5,8 @@
 namespace eigen
 {
 
+    template<class T> class RefCounted;
+
     template<class T> struct RefPtr
     {
         RefPtr() : ptr(0) {}
@@ -70,7 +72,7 @@ namespace eigen
 
         bool isLastRef() const
         {
-            return ptr->_refCount.load(std::memory_order_relaxed) == 1;
+            return _refCount.load(std::memory_order_relaxed) == 1;
         }
 
     protected:
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+namespace eigen
+{
+
+    ///////////////////////////////////////////////////////////////////////////////////////////
+    //
+    // Semaphore
+    //
+    // Counting semaphore that only touches the OS when a thread actually has to sleep or be
+    // woken. wait() can first spin a bounded number of times, trading a little CPU for not
+    // paying the wake-up latency when the signal is about to arrive.
+    //
+
+    class Semaphore
+    {
+    public:
+
+        void                        signal();
+        void                        wait(unsigned spinCount = 0);
+        bool                        tryWait();
+
+    private:
+
+        std::atomic<int>            _count      = 0;    // negative when threads are asleep in wait()
+        int                         _wakeups    = 0;    // granted to sleepers but not yet taken, guarded by _mutex
+        std::mutex                  _mutex;
+        std::condition_variable     _wake;
+    };
+
+    ///////////////////////////////////////////////////////////////////////////////////////////
+    ///////////////////////////////////////////////////////////////////////////////////////////
+
+    inline void Semaphore::signal()
+    {
+        if (_count.fetch_add(1, std::memory_order_release) < 0)
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _wakeups++;
+            _wake.notify_one();
+        }
+    }
+
+    inline bool Semaphore::tryWait()
+    {
+        int count = _count.load(std::memory_order_relaxed);
+        while (count > 0)
+        {
+            if (_count.compare_exchange_weak(count, count - 1, std::memory_order_acquire, std::memory_order_relaxed))
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    inline void Semaphore::wait(unsigned spinCount)
+    {
+        for (unsigned spin = 0; spin < spinCount; spin++)
+        {
+            if (tryWait())
+            {
+                return;
+            }
+            std::this_thread::yield();
+        }
+
+        if (_count.fetch_sub(1, std::memory_order_acquire) > 0)
+        {
+            return;
+        }
+
+        std::unique_lock<std::mutex> lock(_mutex);
+        _wake.wait(lock, [this]() { return _wakeups > 0; });
+        _wakeups--;
+    }
+
+}
@@ -116,7 +116,7 @@ namespace eigen
         return _count;
     }
 
-    template<class T> T* SoftBitFlagAgent<T>::issue(const char* name) throw()
+    template<class T> T* SoftBitFlagAgent<T>::issue(const char* name)
     {
         unsigned nameLength = (unsigned)strlen(name);
 
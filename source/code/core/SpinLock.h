@@ -0,0 +1,47 @@
+#pragma once
+
+#include <atomic>
+#include <thread>
+
+namespace eigen
+{
+
+    ///////////////////////////////////////////////////////////////////////////////////////////
+    //
+    // SpinLock
+    //
+    // For short critical sections that are rarely contended
+    //
+
+    class SpinLock
+    {
+    public:
+
+        void                lock();
+        void                unlock();
+
+    private:
+
+        std::atomic<bool>   _locked = false;
+    };
+
+    ///////////////////////////////////////////////////////////////////////////////////////////
+    ///////////////////////////////////////////////////////////////////////////////////////////
+
+    inline void SpinLock::lock()
+    {
+        while (_locked.exchange(true, std::memory_order_acquire))
+        {
+            while (_locked.load(std::memory_order_relaxed))
+            {
+                std::this_thread::yield();
+            }
+        }
+    }
+
+    inline void SpinLock::unlock()
+    {
+        _locked.store(false, std::memory_order_release);
+    }
+
+}
@@ -0,0 +1,10 @@
+#pragma once
+
+// Thread-local storage for trivially constructible, constant-initialized variables.
+// The v120 toolset has no thread_local keyword.
+
+#if defined(_MSC_VER) && _MSC_VER < 1900
+#define EIGEN_THREAD_LOCAL __declspec(thread)
+#else
+#define EIGEN_THREAD_LOCAL thread_local
+#endif
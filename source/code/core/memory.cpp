@@ -3,7 +3,7 @@
 namespace eigen
 {
 
-    inline BlockAllocator::Block* BlockAllocator::createBlock(Allocator* backing, unsigned capacity)
+    BlockAllocator::Block* BlockAllocator::createBlock(Allocator* backing, unsigned capacity)
     {
         unsigned itemSize = (_allocationSize + 0xf) & ~0xf;
         itemSize += sizeof(Allocation);
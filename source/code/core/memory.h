@@ -3,6 +3,10 @@
 #include <new>
 #include <atomic>
 #include <cassert>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include <cstddef>
 
 namespace eigen
 {
@@ -122,7 +126,8 @@ namespace eigen
 
     template<class T_STRUCT, class T_MEMBER> T_STRUCT* StructFromMember(T_MEMBER T_STRUCT::*ptrToMember, T_MEMBER* member)
     {
-        return (T_STRUCT*)((char*)member - offsetof(T_STRUCT, *ptrToMember));
+        uintptr_t offset = (uintptr_t)&(((T_STRUCT*)nullptr)->*ptrToMember);
+        return (T_STRUCT*)((char*)member - offset);
     }
 
     inline Allocation* Allocation::From(void* memory)
@@ -145,8 +150,12 @@ namespace eigen
     template<class T> T* AllocateMemory(Allocator* allocator, unsigned arrayLength, void* metadata)
     {
         Allocation* allocation = (Allocation*)allocator->allocate(sizeof(Allocation) + sizeof(T)*arrayLength);
+        if (allocation == nullptr)
+        {
+            return nullptr;
+        }
 
-        allocation->_metadata  = metadata;
+        allocation->_metadataPtr = metadata;
         allocation->_allocator = allocator;
 
         return (T*)allocation->getMemory();
@@ -155,6 +164,10 @@ namespace eigen
     template<class T> T* AllocateMemory(Allocator* allocator, unsigned arrayLength)
     {
         Allocation* allocation = (Allocation*)allocator->allocate(sizeof(Allocation) + sizeof(T)*arrayLength);
+        if (allocation == nullptr)
+        {
+            return nullptr;
+        }
 
         allocation->_allocator = allocator;
 
@@ -180,7 +193,7 @@ namespace eigen
         }
     }
 
-    inline Mallocator* Mallocator::Get() throw()
+    inline Mallocator* Mallocator::Get()
     {
         static Mallocator s_mallocator;
         return &s_mallocator;
@@ -0,0 +1,308 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <cassert>
+
+namespace eigen
+{
+
+    ///////////////////////////////////////////////////////////////////////////////////////////
+    //
+    // Functions
+    //
+    // Sorting for records with an unsigned integer "sortKey" member (32 or 64 bits), ascending by
+    // key. RadixSort needs a scratch array of the same length and is stable; InsertionSort is for
+    // tiny arrays.
+    // AdaptiveSort is near-linear on almost-sorted input, and falls back to RadixSort otherwise.
+    // BucketSort only approximates the order, in linear time: bucketOf maps each key to one of
+    // bucketCount buckets (ascending with the key), and items keep input order within a bucket.
+    // MergeSortedRuns combines up to MaxMergeRuns already-sorted arrays, handing each item in
+    // order to emit(item, runIndex).
+    //
+    // RadixCount and RadixScatter are one digit pass of RadixSort, split so that slices of an
+    // array can be counted and scattered on separate threads.
+    //
+
+    enum {                      RadixPasses = 8, RadixDigits = 256 };
+    enum {                      MaxMergeRuns = 64 };
+    enum {                      MaxSortBuckets = 1024 };
+
+    template<class T> struct SortedRun
+    {
+        const T*                items;
+        unsigned                count;
+        uint64_t                keyFlip;        // nonzero if sorted the opposite way: read back to front, keys xor'd
+    };
+
+    uint32_t                    OrderableFromFloat(float f);    // unsigned compare matches float compare
+    float                       FloatFromOrderable(uint32_t bits);
+
+    template<class T> void      InsertionSort(T* items, unsigned count);
+    template<class T> void      RadixSort(T* items, T* scratch, unsigned count);
+    template<class T> void      AdaptiveSort(T* items, T* scratch, unsigned count);
+    template<class T> void      RadixCount(const T* items, unsigned count, unsigned pass, unsigned* histogram);
+    template<class T> void      RadixScatter(const T* items, T* out, unsigned count, unsigned pass, unsigned* offsets);
+    template<class T, class BucketOf>
+    void                        BucketSort(T* items, T* scratch, unsigned count, unsigned bucketCount, BucketOf bucketOf);
+    template<class T, class Emit>
+    void                        MergeSortedRuns(const SortedRun<T>* runs, unsigned runCount, Emit emit);
+
+    ///////////////////////////////////////////////////////////////////////////////////////////
+    ///////////////////////////////////////////////////////////////////////////////////////////
+
+    inline uint32_t OrderableFromFloat(float f)
+    {
+        uint32_t bits;
+        memcpy(&bits, &f, sizeof(bits));
+
+        // Negative floats: flip everything so larger magnitudes sort first
+        // Positive floats: flip the sign bit so they sort after all negatives
+
+        uint32_t mask = (uint32_t)((int32_t)bits >> 31) | 0x80000000;
+        return bits ^ mask;
+    }
+
+    inline float FloatFromOrderable(uint32_t bits)
+    {
+        uint32_t mask = (bits & 0x80000000) ? 0x80000000 : 0xffffffff;
+        bits ^= mask;
+
+        float f;
+        memcpy(&f, &bits, sizeof(f));
+        return f;
+    }
+
+    template<class T> void InsertionSort(T* items, unsigned count)
+    {
+        for (unsigned i = 1; i < count; i++)
+        {
+            T item = items[i];
+            unsigned j = i;
+            for (; j > 0 && item.sortKey < items[j-1].sortKey; j--)
+            {
+                items[j] = items[j-1];
+            }
+            items[j] = item;
+        }
+    }
+
+    template<class T> void RadixCount(const T* items, unsigned count, unsigned pass, unsigned* histogram)
+    {
+        for (unsigned i = 0; i < count; i++)
+        {
+            histogram[(items[i].sortKey >> (pass*8)) & 0xff]++;
+        }
+    }
+
+    template<class T> void RadixScatter(const T* items, T* out, unsigned count, unsigned pass, unsigned* offsets)
+    {
+        // offsets[digit] is where the next item with that digit goes, and is advanced past it
+
+        for (unsigned i = 0; i < count; i++)
+        {
+            unsigned digit = (items[i].sortKey >> (pass*8)) & 0xff;
+            out[offsets[digit]++] = items[i];
+        }
+    }
+
+    template<class T> void RadixSort(T* items, T* scratch, unsigned count)
+    {
+        enum { Passes = sizeof(((T*)nullptr)->sortKey), Radix = RadixDigits };
+
+        if (count < 2)
+        {
+            return;
+        }
+
+        unsigned histograms[Passes][Radix];
+        memset(histograms, 0, sizeof(histograms));
+
+        // One read pass builds every digit's histogram
+
+        for (unsigned i = 0; i < count; i++)
+        {
+            uint64_t key = items[i].sortKey;
+            for (unsigned pass = 0; pass < Passes; pass++)
+            {
+                histograms[pass][(key >> (pass*8)) & 0xff]++;
+            }
+        }
+
+        T* src = items;
+        T* dst = scratch;
+
+        for (unsigned pass = 0; pass < Passes; pass++)
+        {
+            unsigned* histogram = histograms[pass];
+
+            // Skip digits that are identical for all keys (e.g. the upper half of depth keys)
+
+            if (histogram[(src[0].sortKey >> (pass*8)) & 0xff] == count)
+            {
+                continue;
+            }
+
+            unsigned offset = 0;
+            for (unsigned digit = 0; digit < Radix; digit++)
+            {
+                unsigned n = histogram[digit];
+                histogram[digit] = offset;
+                offset += n;
+            }
+
+            RadixScatter(src, dst, count, pass, histogram);
+
+            T* swap = src;
+            src = dst;
+            dst = swap;
+        }
+
+        if (src != items)
+        {
+            memcpy(items, src, sizeof(T)*count);
+        }
+    }
+
+    template<class T> void AdaptiveSort(T* items, T* scratch, unsigned count)
+    {
+        // Insertion sort costs one step per item plus one per inversion, so give up on it
+        // once the inversions show the input wasn't nearly sorted after all
+
+        enum { MovesPerItem = 8 };
+
+        uint64_t budget = (uint64_t)count * MovesPerItem;
+
+        for (unsigned i = 1; i < count; i++)
+        {
+            T item = items[i];
+            unsigned j = i;
+            for (; j > 0 && item.sortKey < items[j-1].sortKey; j--)
+            {
+                items[j] = items[j-1];
+            }
+            items[j] = item;
+
+            unsigned moves = i - j;
+            if (moves > budget)
+            {
+                RadixSort(items, scratch, count);
+                return;
+            }
+            budget -= moves;
+        }
+    }
+
+    template<class T, class BucketOf> void BucketSort(T* items, T* scratch, unsigned count, unsigned bucketCount, BucketOf bucketOf)
+    {
+        assert(bucketCount > 0 && bucketCount <= MaxSortBuckets);
+
+        unsigned histogram[MaxSortBuckets];
+        memset(histogram, 0, sizeof(unsigned) * bucketCount);
+
+        for (unsigned i = 0; i < count; i++)
+        {
+            histogram[bucketOf(items[i].sortKey)]++;
+        }
+
+        unsigned offset = 0;
+        for (unsigned bucket = 0; bucket < bucketCount; bucket++)
+        {
+            unsigned n = histogram[bucket];
+            histogram[bucket] = offset;
+            offset += n;
+        }
+
+        for (unsigned i = 0; i < count; i++)
+        {
+            scratch[histogram[bucketOf(items[i].sortKey)]++] = items[i];
+        }
+
+        memcpy(items, scratch, sizeof(T)*count);
+    }
+
+    template<class T> inline T SortedRunItem(const SortedRun<T>& run, unsigned taken)
+    {
+        T item = run.items[run.keyFlip ? run.count - 1 - taken : taken];
+        item.sortKey ^= (decltype(item.sortKey))run.keyFlip;
+        return item;
+    }
+
+    template<class T, class Emit> void MergeSortedRuns(const SortedRun<T>* runs, unsigned runCount, Emit emit)
+    {
+        assert(runCount <= MaxMergeRuns);
+
+        // Binary min-heap of each run's next item
+
+        struct Head
+        {
+            uint64_t    key;
+            unsigned    run;
+            unsigned    taken;
+        };
+
+        Head heap[MaxMergeRuns];
+        unsigned heapSize = 0;
+
+        for (unsigned i = 0; i < runCount; i++)
+        {
+            if (runs[i].count > 0)
+            {
+                Head& head = heap[heapSize++];
+                head.key = SortedRunItem(runs[i], 0).sortKey;
+                head.run = i;
+                head.taken = 0;
+            }
+        }
+
+        auto siftDown = [&](unsigned i)
+        {
+            Head head = heap[i];
+            for (unsigned child = 2*i + 1; child < heapSize; child = 2*i + 1)
+            {
+                child += (child + 1 < heapSize && heap[child + 1].key < heap[child].key) ? 1 : 0;
+                if (head.key <= heap[child].key)
+                {
+                    break;
+                }
+                heap[i] = heap[child];
+                i = child;
+            }
+            heap[i] = head;
+        };
+
+        for (unsigned i = heapSize / 2; i-- > 0;)
+        {
+            siftDown(i);
+        }
+
+        while (heapSize > 1)
+        {
+            Head& top = heap[0];
+            const SortedRun<T>& run = runs[top.run];
+            emit(SortedRunItem(run, top.taken++), top.run);
+
+            if (top.taken == run.count)
+            {
+                top = heap[--heapSize];
+            }
+            else
+            {
+                top.key = SortedRunItem(run, top.taken).sortKey;
+            }
+            siftDown(0);
+        }
+
+        // Last run standing is copied straight through
+
+        if (heapSize == 1)
+        {
+            const SortedRun<T>& run = runs[heap[0].run];
+            for (unsigned taken = heap[0].taken; taken < run.count; taken++)
+            {
+                emit(SortedRunItem(run, taken), heap[0].run);
+            }
+        }
+    }
+
+}
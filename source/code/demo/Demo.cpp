@@ -221,7 +221,13 @@ void Demo::run()
 
             batchQ->finish();
 
-            renderer.commenceWork();
+            error = renderer.commenceWork();
+            if (Failed(error))
+            {
+                puts(error.getText());
+                MessageBoxA(_hwnd, error.getText(), "Error", MB_OK);
+                return;
+            }
 
             Sleep(0);
         }
@@ -1,49 +1,46 @@
 #include "BatchQueue.h"
 #include "Renderer.h"
+#include <algorithm>
 
 namespace eigen
 {
 
     BatchQueue* BatchQueue::Create(Renderer* renderer, const RenderPlan* plan)
     {
-        unsigned binRangeStart, binRangeEnd;
-        plan->_binMask.getRange(binRangeStart, binRangeEnd);
+        const RenderPlan::Compiled* compiled = plan->getCompiled();
+        assert(compiled != nullptr);    // plan must be validated first
 
-        unsigned sortCacheMask = FloodBitsRight(plan->_count * 2);
+        unsigned binRangeStart = compiled->binRangeStart;
+        unsigned binRangeEnd = compiled->binRangeEnd;
 
         uintptr_t sizeOfBatchLists = sizeof(BatchList) * (binRangeEnd - binRangeStart);
-        uintptr_t sizeOfStages = (uintptr_t)plan->_end - (uintptr_t)plan->_start;
-        uintptr_t sizeOfPerfSortCache = sizeof(SortCacheEntry) * (sortCacheMask+1);
-        uintptr_t sizeOfDepthSortCache = sizeof(SortCacheEntry) * (sortCacheMask+1);
+        uintptr_t sizeOfSortResults = sizeof(CachedSort*) * compiled->sortGroupCount;
 
-        uintptr_t bytes = sizeof(BatchQueue) + sizeOfBatchLists + sizeOfStages + sizeOfPerfSortCache + sizeOfDepthSortCache + ChunkSize;
+        uintptr_t bytes = sizeof(BatchQueue) + sizeOfBatchLists + sizeOfSortResults;
         BatchQueue* batchQ = (BatchQueue*)renderer->scratchAlloc(bytes);
-        assert(batchQ != nullptr); // out of scratch memory TODO
+        if (batchQ == nullptr)
+        {
+            return nullptr;     // out of scratch memory
+        }
 
+        batchQ->_next = nullptr;
         batchQ->_renderer = renderer;
+        batchQ->_plan = compiled;
         batchQ->_batchLists = (BatchList*)(batchQ + 1) - binRangeStart;    // subtract start here instead of offsetting later
-        batchQ->_stages = (Stage*)(batchQ->_batchLists + binRangeEnd);
-        batchQ->_perfSortCache = (SortCacheEntry*)((int8_t*)batchQ->_stages + sizeOfStages);
-        batchQ->_depthSortCache = batchQ->_perfSortCache + sortCacheMask+1;
-        batchQ->_buffer = (int8_t*)batchQ->_depthSortCache + sizeOfDepthSortCache;
-        batchQ->_bufferEnd = batchQ->_buffer + ChunkSize;
-        batchQ->_binMask = plan->_binMask;
-        batchQ->_stagesCount = plan->_count;
-        batchQ->_sortCacheMask = sortCacheMask;
-        batchQ->_binRangeStart = binRangeStart;
-        batchQ->_binRangeEnd = binRangeEnd;
-
-        //memcpy(batchQ->_sortMasks, plan->_sortMasks, sizeof(batchQ->_sortMasks));
-
-        // copy stages into scratch memory
-        memcpy(batchQ->_stages, plan->_start, (int8_t*)plan->_end - (int8_t*)plan->_start);
+        batchQ->_sortResults = (CachedSort**)(batchQ->_batchLists + binRangeEnd);
+        batchQ->_binMask = compiled->binMask;
+        batchQ->_finishedBins.clear();
+        batchQ->_stagesDispatched = 0;
+        new(&batchQ->_finishLock) SpinLock();
 
         // clear batch slots
-        memset(batchQ->_batchLists + binRangeStart, 0, sizeOfBatchLists);
+        for (unsigned i = binRangeStart; i < binRangeEnd; i++)
+        {
+            new(&batchQ->_batchLists[i].head) std::atomic<BatchChunk*>(nullptr);
+        }
 
-        // clear sort caches
-        memset(batchQ->_perfSortCache, 0, sizeOfPerfSortCache);
-        memset(batchQ->_depthSortCache, 0, sizeOfDepthSortCache);
+        // clear sort results
+        memset(batchQ->_sortResults, 0, sizeOfSortResults);
 
         return batchQ;
     }
@@ -57,43 +54,175 @@ namespace eigen
             return;
         }
 
-        // Create committed batch in scratch memory
+        commitToBin(bin->getPosition(), batch, sortDepth, performanceKeyFor(batch, bin->getBit()));
+    }
+
+    void BatchQueue::commitBatch(RenderBatch* batch, const RenderBin::Set& binSelection, float sortDepth)
+    {
+        // Bins the pipeline doesn't reference are dropped all at once
+
+        RenderBin::Set routed = binSelection;
+        routed &= _binMask;
 
-        unsigned bytes = sizeof(BatchListEntry);// + dataCount*sizeof(StructData*);
+        uint64_t performanceSortKey = performanceKeyFor(batch, routed);
 
-        if (_buffer + bytes > _bufferEnd)
+        routed.forEach(
+            [&](unsigned position, const RenderBin::Set&)
+            {
+                commitToBin(position, batch, sortDepth, performanceSortKey);
+            }
+        );
+    }
+
+    void BatchQueue::commitToBin(unsigned position, RenderBatch* batch, float sortDepth, uint64_t performanceSortKey)
+    {
+        unsigned slot, slotEnd;
+        BatchChunk* chunk = reserveSlots(_batchLists[position], 1, slot, slotEnd);
+        if (chunk == nullptr)
         {
-            int8_t* p = _renderer->scratchAlloc(ChunkSize);
-            if (p == nullptr)
+            dropBatches(1);
+            return;
+        }
+
+        // Nobody reads the chunks until the bin is finished, so plain stores are enough
+
+        chunk->batches[slot]                = batch;
+        chunk->performanceSortKeys[slot]    = performanceSortKey;
+        chunk->sortDepths[slot]             = sortDepth;
+    }
+
+    void BatchQueue::commitBatches(RenderBatch* const* batches, const RenderBin* const* bins, const float* sortDepths, unsigned count)
+    {
+        // Count accepted batches per bin up front, so each bin reserves its slots in as few steps as possible.
+        // Rejected batches are tallied in an extra slot past the real bins, which keeps the counting loop branch-free.
+
+        enum { Rejected = MaxRenderBins };
+
+        uint8_t binRoute[MaxRenderBins];
+        bool needsKey[MaxRenderBins];
+        for (unsigned i = 0; i < MaxRenderBins; i++)
+        {
+            binRoute[i] = _binMask.test(i) ? (uint8_t)i : (uint8_t)Rejected;
+            needsKey[i] = _plan->performanceBins.test(i);
+        }
+
+        unsigned binCounts[MaxRenderBins + 1] = {};
+        for (unsigned i = 0; i < count; i++)
+        {
+            binCounts[binRoute[bins[i]->getPosition()]]++;
+        }
+
+        if (binCounts[Rejected] == count)
+        {
+            return;
+        }
+
+        struct Cursor
+        {
+            BatchChunk*     chunk;
+            unsigned        slot;
+            unsigned        slotEnd;
+        };
+
+        Cursor cursors[MaxRenderBins];
+        memset(cursors, 0, sizeof(cursors));
+
+        for (unsigned i = 0; i < count; i++)
+        {
+            unsigned position = binRoute[bins[i]->getPosition()];
+            if (position == Rejected)
+            {
+                continue;
+            }
+
+            Cursor& cursor = cursors[position];
+            if (cursor.slot == cursor.slotEnd)
             {
-                // error TODO
-                return;
+                cursor.chunk = reserveSlots(_batchLists[position], binCounts[position], cursor.slot, cursor.slotEnd);
+                if (cursor.chunk == nullptr)
+                {
+                    // Nothing was reserved, so drop the bin's remaining batches and carry on filling the slots
+                    // other bins already reserved, which mustn't be left holding garbage
+
+                    dropBatches(binCounts[position]);
+                    binRoute[position] = Rejected;
+                    continue;
+                }
+                binCounts[position] -= cursor.slotEnd - cursor.slot;
             }
-            _buffer     = p;
-            _bufferEnd  = p + ChunkSize;
-            assert(_buffer + bytes <= _bufferEnd);
+
+            unsigned slot = cursor.slot++;
+            cursor.chunk->batches[slot]                 = batches[i];
+            cursor.chunk->performanceSortKeys[slot]     = needsKey[position] && batches[i] ? _plan->performanceKeyLayout.build(batches[i]->getStateIds()) : 0;
+            cursor.chunk->sortDepths[slot]              = sortDepths[i];
         }
+    }
+
+    BatchQueue::BatchChunk* BatchQueue::reserveSlots(BatchList& batchList, unsigned want, unsigned& slotStart, unsigned& slotEnd)
+    {
+        // Reserves up to want consecutive slots (at least one) in the bin's current chunk
+
+        BatchChunk* chunk = batchList.head.load(std::memory_order_acquire);
+        BatchChunk* spare = nullptr;
+
+        while (true)
+        {
+            if (chunk != nullptr)
+            {
+                unsigned slot = chunk->reserved.fetch_add(want, std::memory_order_relaxed);
+                if (slot < BatchChunk::Capacity)
+                {
+                    slotStart = slot;
+                    slotEnd = std::min(slot + want, (unsigned)BatchChunk::Capacity);
+                    return chunk;
+                }
+            }
+
+            // Chunk is full (or bin is empty), so try to install a fresh one with our slots taken
+
+            if (spare == nullptr)
+            {
+                spare = (BatchChunk*)_renderer->scratchAlloc(sizeof(BatchChunk));
+                if (spare == nullptr)
+                {
+                    return nullptr;
+                }
+            }
 
-        BatchListEntry* entry = (BatchListEntry*)_buffer;
-        _buffer += bytes;
+            unsigned taken = std::min(want, (unsigned)BatchChunk::Capacity);
+            spare->next = chunk;
+            spare->reserved.store(taken, std::memory_order_relaxed);
 
-        entry->next                 = nullptr;
-        entry->sortDepth            = sortDepth;
-        entry->performanceSortKey   = 0;//batch->shaderId
+            if (batchList.head.compare_exchange_strong(chunk, spare, std::memory_order_release, std::memory_order_acquire))
+            {
+                slotStart = 0;
+                slotEnd = taken;
+                return spare;
+            }
 
-        // Commit batch to list
+            // Another thread installed one first (chunk now points at it), keep the spare in case it fills too
+        }
+    }
+
+    void BatchQueue::dropBatches(unsigned count)
+    {
+        _renderer->_droppedBatches.fetch_add(count, std::memory_order_relaxed);
+    }
+
+    void BatchQueue::finishBins(const RenderBin::Set& bins)
+    {
+        // Releases this thread's commits to whichever thread prepares the stages they feed
 
-        BatchList& batchList = _batchLists[bin->getPosition()];
-        //entry->next = batchList.head.exchange(entry, std::memory_order_relaxed);  // [cb->next = head; head = cb;]
-        entry->next = batchList.head;
-        batchList.head = entry;
-        batchList.count++;
+        _finishLock.lock();
+        _finishedBins |= bins;
+        _finishLock.unlock();
     }
 
     void BatchQueue::finish()
     {
         _binMask.clear();
         _renderer = nullptr;
+        finishBins(_plan->binMask);
     }
 
 }
@@ -1,8 +1,12 @@
 #pragma once
 #include <cstdint>
+#include <atomic>
+#include <algorithm>
 
+#include "core/SpinLock.h"
 #include "RenderBin.h"
 #include "RenderPlan.h"
+#include "RenderBatch.h"
 
 namespace eigen
 {
@@ -16,9 +20,18 @@ namespace eigen
     //
     // Accumulates all the batches (draw calls) to be issued via a RenderPlan.
     //
-    // Use Renderer::openBatchQueue() to acquire one.
+    // Use Renderer::openBatchQueue() to acquire one. Queues may be opened and finished from any
+    // thread, and are submitted in order of the priority they were opened with, lowest first. No
+    // two queues in a frame may share a priority.
     //
-    // TODO - Is it threadsafe, or one thread per batchQ and merge downsteam?
+    // commitBatch() may be called from any number of threads at once. Each bin stores its batches
+    // in fixed-size chunks; committers reserve slots with an atomic increment and only race to
+    // install a new chunk when the current one fills. All commits must happen-before finish().
+    //
+    // finishBins() declares that some bins are complete before the rest of the queue is. Stages
+    // that draw only from finished bins can then be sorted and submitted while commits to other
+    // bins carry on, see Renderer::commenceFinishedStages(). Commits to a bin must happen-before
+    // it is finished.
     //
 
     class BatchQueue
@@ -30,10 +43,14 @@ namespace eigen
 
         void                commitBatch(RenderBatch* batch, const RenderBin* bin, float sortDepth);
 
-        // TODO - plural RenderBin, defined by Effect (referenced by RenderBatch)
-        // API then becomes:
-        //void                commitBatch(RenderBatch* batch, const RenderBin::Set& binSelection, float sortDepth);
+        // Same as count calls to commitBatch(), but filters and reserves per bin rather than per batch
+        void                commitBatches(RenderBatch* const* batches, const RenderBin* const* bins, const float* sortDepths, unsigned count);
+
+        // Routes the batch to every bin in binSelection that the plan uses, with a single filter test.
+        // TODO - bins defined by Effect (referenced by RenderBatch)
+        void                commitBatch(RenderBatch* batch, const RenderBin::Set& binSelection, float sortDepth);
 
+        void                finishBins(const RenderBin::Set& bins);    // no more batches for these bins
         void                finish();
 
         //
@@ -41,94 +58,144 @@ namespace eigen
 
     protected:
 
-        struct BatchListEntry
+        struct BatchChunk
         {
-            BatchListEntry* next;
-            float           sortDepth;
-            unsigned        performanceSortKey;
-            //Batch         batch;    // shallow copy, variable # of paramblocks follow in memory
+            enum {                  Capacity = 256 };
+
+            unsigned                getCount() const;
+
+            BatchChunk*             next;                   // older chunk of the same bin
+            std::atomic<unsigned>   reserved;               // slots handed out, overshoots Capacity once full
+
+            // Columns are split so that sorting reads only the keys it needs
+
+            RenderBatch*            batches[Capacity];
+            uint64_t                performanceSortKeys[Capacity];     // zero unless the bin is sorted by state
+            float                   sortDepths[Capacity];
         };
 
+        // Both record kinds share an interface, so sorting code is written once. A record filled
+        // with 0xff bytes is vacant.
+
         struct SortBatch
         {
+            RenderBatch*    getBatch(RenderBatch* const* batchTable) const;
+            void            setBatch(unsigned index, RenderBatch* batch, RenderBatch** batchTable);
+            bool            isVacant() const;
+
             uint64_t        sortKey;
             RenderBatch*    batch;
 
             bool            operator<(const SortBatch& other) const;
         };
 
-        struct BatchList
-        {
-            BatchListEntry* head;
-            int             count;
-        };
+        // Depth keys fit in 32 bits, so depth sorts move half as much with the batch looked up by index
 
-        struct CachedSort
+        struct CompactSortBatch
         {
-            RenderBin::Set  binMask;
-            SortBatch*      batches;
-            unsigned        count;
+            RenderBatch*    getBatch(RenderBatch* const* batchTable) const;
+            void            setBatch(unsigned index, RenderBatch* batch, RenderBatch** batchTable);
+            bool            isVacant() const;
+
+            uint32_t        sortKey;
+            uint32_t        index;      // into CachedSort::batchTable
         };
 
-        struct SortCacheEntry
+        struct BatchList
         {
-            unsigned        lookupKey;
-            CachedSort*     cached;
+            unsigned                        getCount() const;
+
+            std::atomic<BatchChunk*>        head;       // chunk being filled, followed by full ones
         };
 
-        enum
+        struct CachedSort
         {
-                            ChunkSize = 16*1024,
+            RenderBatch*        getBatch(unsigned i) const;
+
+            void*               records;        // SortBatch, or CompactSortBatch if batchTable is set
+            RenderBatch* const* batchTable;     // batches of compact records, by index
+            unsigned            count;
         };
+
                             friend class Renderer;
                             friend class RenderDispatch;
 
         static BatchQueue*    Create(Renderer* renderer, const RenderPlan* plan);
 
-        SortCacheEntry&     findCachedDepthSort(const RenderBin::Set& bins) const; 
-        SortCacheEntry&     findCachedPerfSort(const RenderBin::Set& bins) const; 
+        uint64_t            performanceKeyFor(const RenderBatch* batch, const RenderBin::Set& bins) const;
+        void                commitToBin(unsigned position, RenderBatch* batch, float sortDepth, uint64_t performanceSortKey);
+        BatchChunk*         reserveSlots(BatchList& batchList, unsigned want, unsigned& slotStart, unsigned& slotEnd);
+        void                dropBatches(unsigned count);    // out of scratch memory, see Renderer::commenceWork()
 
         BatchQueue*           _next               = nullptr;
         Renderer*           _renderer           = nullptr;
-        Stage*              _stages             = nullptr;
+        const RenderPlan::Compiled* _plan       = nullptr;  // shared with the plan, see RenderPlan::Compiled
         BatchList*          _batchLists         = nullptr;
-        int8_t*             _buffer             = nullptr;
-        int8_t*             _bufferEnd          = nullptr;
-        SortCacheEntry*     _perfSortCache      = nullptr;
-        SortCacheEntry*     _depthSortCache     = nullptr;
+        CachedSort**        _sortResults        = nullptr;  // one per sort group, filled in at dispatch
         RenderBin::Set      _binMask;
-        unsigned            _stagesCount        = 0;
-        unsigned            _sortCacheMask      = 0;
-        unsigned            _binRangeStart      = 0;
-        unsigned            _binRangeEnd        = 0;
+        SpinLock            _finishLock;                    // finishing threads publish _finishedBins to dispatch
+        RenderBin::Set      _finishedBins;                  // no more commits, so their stages may be dispatched
+        unsigned            _stagesDispatched   = 0;        // plan stages handed to dispatch so far, in order
+        int                 _priority           = 0;        // submission order, see Renderer::openBatchQueue()
     };
 
-    inline BatchQueue::SortCacheEntry& BatchQueue::findCachedDepthSort(const RenderBin::Set& bins) const
+    inline unsigned BatchQueue::BatchChunk::getCount() const
     {
-        unsigned hash = bins.hash();
+        return std::min(reserved.load(std::memory_order_relaxed), (unsigned)Capacity);
+    }
 
-        for (unsigned i = hash & _sortCacheMask; ; i = (i+1) & _sortCacheMask)
+    inline unsigned BatchQueue::BatchList::getCount() const
+    {
+        unsigned count = 0;
+        for (const BatchChunk* chunk = head.load(std::memory_order_relaxed); chunk; chunk = chunk->next)
         {
-            if (_depthSortCache[i].lookupKey == 0 || _depthSortCache[i].lookupKey == hash)
-            {
-                _depthSortCache[i].lookupKey = hash;
-                return _depthSortCache[i];
-            }
+            count += chunk->getCount();
         }
+        return count;
     }
 
-    inline BatchQueue::SortCacheEntry& BatchQueue::findCachedPerfSort(const RenderBin::Set& bins) const
+    inline uint64_t BatchQueue::performanceKeyFor(const RenderBatch* batch, const RenderBin::Set& bins) const
     {
-        unsigned hash = bins.hash();
+        // Keys are only built where a Performance sort will read them. Null batches (placeholders) get zero.
 
-        for (unsigned i = hash & _sortCacheMask; ; i = (i+1) & _sortCacheMask)
-        {
-            if (_perfSortCache[i].lookupKey == 0 || _perfSortCache[i].lookupKey == hash)
-            {
-                _perfSortCache[i].lookupKey = hash;
-                return _depthSortCache[i];
-            }
-        }
+        return batch && bins.intersects(_plan->performanceBins) ? _plan->performanceKeyLayout.build(batch->getStateIds()) : 0;
+    }
+
+    inline RenderBatch* BatchQueue::SortBatch::getBatch(RenderBatch* const*) const
+    {
+        return batch;
+    }
+
+    inline void BatchQueue::SortBatch::setBatch(unsigned, RenderBatch* batch_, RenderBatch**)
+    {
+        batch = batch_;
+    }
+
+    inline bool BatchQueue::SortBatch::isVacant() const
+    {
+        return (uintptr_t)batch == ~(uintptr_t)0;
+    }
+
+    inline RenderBatch* BatchQueue::CompactSortBatch::getBatch(RenderBatch* const* batchTable) const
+    {
+        return batchTable[index];
+    }
+
+    inline void BatchQueue::CompactSortBatch::setBatch(unsigned index_, RenderBatch* batch, RenderBatch** batchTable)
+    {
+        index = index_;
+        batchTable[index] = batch;
+    }
+
+    inline bool BatchQueue::CompactSortBatch::isVacant() const
+    {
+        return index == ~0u;
+    }
+
+    inline RenderBatch* BatchQueue::CachedSort::getBatch(unsigned i) const
+    {
+        assert(i < count);
+        return batchTable ? batchTable[((const CompactSortBatch*)records)[i].index] : ((const SortBatch*)records)[i].batch;
     }
 
     inline bool BatchQueue::SortBatch::operator<(const SortBatch& other) const
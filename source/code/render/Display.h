@@ -27,7 +27,7 @@ namespace eigen
                             Display() {}
                             ~Display();
 
-        void                present();
+        void                present(unsigned frameNumber);
 
         TexturePtr          _target;
         int                 _index = 0;
@@ -75,4 +75,9 @@ namespace eigen
 
     ///////////////////////////////////////////////////////////////////////////////////////////
 
+    inline const Effect::Info& Effect::getInfo() const
+    {
+        return _info;
+    }
+
 }
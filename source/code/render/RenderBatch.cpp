@@ -0,0 +1,38 @@
+#include "RenderBatch.h"
+#include "Effect.h"
+#include "core/hash.h"
+
+namespace eigen
+{
+    inline uint32_t HashPointer(const void* p)
+    {
+        // Upper half of a Fibonacci hash, so that any low bits a key keeps are well mixed
+
+        return (uint32_t)(((uint64_t)(uintptr_t)p * 0x9E3779B97F4A7C15ull) >> 32);
+    }
+
+    RenderBatch::RenderBatch()
+        : _effect(nullptr)
+        , _data(nullptr)
+        , _bytes(sizeof(RenderBatch))
+        , _parameterBlockCount(0)
+    {
+        // Zero keys until the creating path sets state and calls updateStateIds()
+
+        memset(_stateIds, 0, sizeof(_stateIds));
+    }
+
+    void RenderBatch::updateStateIds()
+    {
+        // Parameter blocks live inside the batch, so they're identified by content rather than address
+
+        const uint8_t* blocksStart = (const uint8_t*)firstParameterBlock();
+        const uint8_t* blocksEnd = (const uint8_t*)this + _bytes;
+
+        _stateIds[PerformanceKeyLayout::Effect]             = HashPointer(_effect);
+        _stateIds[PerformanceKeyLayout::Aspects]            = _effect ? _effect->getInfo().aspects.hash() : 0;
+        _stateIds[PerformanceKeyLayout::Data]               = HashPointer(_data);
+        _stateIds[PerformanceKeyLayout::ParameterBlocks]    = blocksEnd > blocksStart ? Hash32((const char*)blocksStart, (int)(blocksEnd - blocksStart)) : 0;
+    }
+
+}
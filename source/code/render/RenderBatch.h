@@ -9,6 +9,34 @@ namespace eigen
     class RenderData;       // collection of buffers conforming to Effect specifications
     class ParameterBlock;
 
+    ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+    //
+    // PerformanceKeyLayout
+    //
+    // How SortType::Performance orders batches. Identities of a batch's effect, effect aspects, render data and
+    // parameter blocks are packed into a 64-bit key as bit fields, most significant first, so batches sharing the
+    // leading fields are drawn together and the state they share isn't bound again. Set per RenderPlan.
+    //
+
+    struct PerformanceKeyLayout
+    {
+        enum Field          : uint8_t
+        {
+                            Effect          = 0,
+                            Aspects,
+                            Data,
+                            ParameterBlocks,
+                            FieldCount
+        };
+
+        enum {              MaxFieldBits    = 32 };
+
+        Field               order[FieldCount]   = {Effect, Aspects, Data, ParameterBlocks};
+        uint8_t             bits[FieldCount]    = {20, 8, 20, 16};     // by Field, at most 64 in total
+
+        uint64_t            build(const uint32_t* stateIds) const;
+    };
+
     ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
     //
     // RenderBatch
@@ -41,10 +69,14 @@ namespace eigen
         unsigned            getParameterBlockCount() const;
         ParameterBlock*     getParameterBlock(int i) const;
 
+        const uint32_t*     getStateIds() const;    // hashed identities, indexed by PerformanceKeyLayout::Field
+
     protected:
                             RenderBatch();
                             ~RenderBatch();
 
+        void                updateStateIds();       // by creators, whenever the effect, data or parameter blocks change
+
         uint8_t*            getParameterBlockOffsets() const;
         ParameterBlock*     firstParameterBlock() const;
 
@@ -52,9 +84,26 @@ namespace eigen
         RenderData*         _data;
         unsigned            _bytes;
         unsigned            _parameterBlockCount;
+        uint32_t            _stateIds[PerformanceKeyLayout::FieldCount];
 
     };
 
+    inline uint64_t PerformanceKeyLayout::build(const uint32_t* stateIds) const
+    {
+        uint64_t key = 0;
+        for (unsigned i = 0; i < FieldCount; i++)
+        {
+            unsigned width = bits[order[i]];
+            key = (key << width) | (stateIds[order[i]] & (((uint64_t)1 << width) - 1));
+        }
+        return key;
+    }
+
+    inline const uint32_t* RenderBatch::getStateIds() const
+    {
+        return _stateIds;
+    }
+
     inline uint8_t* RenderBatch::getParameterBlockOffsets() const
     {
         return (uint8_t*)(this+1);
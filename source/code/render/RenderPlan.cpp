@@ -1,5 +1,6 @@
 #include "RenderPlan.h"
 #include "Renderer.h"
+#include "core/sort.h"
 
 namespace eigen
 {
@@ -19,12 +20,49 @@ namespace eigen
         }
     }
 
+    static std::atomic<unsigned> s_lastCompileSerial(0);
+
+    inline int FindRunGroup(const RenderPlan::SortGroup* sortGroups, unsigned sortGroupCount, unsigned binPosition, BatchStage::SortType sortType, uint16_t depthBuckets)
+    {
+        // Prefer a run in the same order, but depth runs can be merged back to front
+
+        BatchStage::SortType reversedType = BatchStage::Reversed(sortType);
+        int reversed = -1;
+
+        for (unsigned i = 0; i < sortGroupCount; i++)
+        {
+            const RenderPlan::SortGroup& sortGroup = sortGroups[i];
+            if (sortGroup.binCount != 1 || sortGroup.binPositions[0] != binPosition || sortGroup.depthBuckets != depthBuckets)
+            {
+                continue;
+            }
+            if (sortGroup.sortType == sortType)
+            {
+                return (int)i;
+            }
+            if (reversedType != sortType && sortGroup.sortType == reversedType)
+            {
+                reversed = (int)i;
+            }
+        }
+
+        return reversed;
+    }
+
+    inline bool BucketSortsAnyBin(const BatchStage& stage)
+    {
+        return BatchStage::IsApproximate(stage.sortType)
+            || (BatchStage::Approximated(stage.sortType) != stage.sortType && stage.approximateBins.intersects(stage.attachedBins));
+    }
+
     RenderPlan::RenderPlan()
     {
     }
 
     RenderPlan::~RenderPlan()
     {
+        FreeMemory(_compiled);
+
         if (--Allocation::From(_start)->_metadataInt == 0)
         {
             for (Stage* stage = _start; stage < _end; stage = stage->advance())
@@ -44,7 +82,6 @@ namespace eigen
         }
 
         RenderBin::Set bins;
-        RenderBin::Set sortMasks[BatchStage::SortType::Count];
         unsigned bytes = 0;
         for (unsigned i = 0; i < stageCount; i++)
         {
@@ -68,8 +105,15 @@ namespace eigen
                 {
                     EIGEN_RETURN_ERROR("Stage %d has invalid sort type", (long)i);
                 }
+                if (stage->depthBuckets == 0)
+                {
+                    EIGEN_RETURN_ERROR("Stage %d has no depth buckets", (long)i);
+                }
+                if (BucketSortsAnyBin(*stage) && stage->depthBuckets > MaxSortBuckets)
+                {
+                    EIGEN_RETURN_ERROR("A stage bucket sorts with more than %d depth buckets", (long)MaxSortBuckets);
+                }
                 bins |= stage->attachedBins;
-                sortMasks[stage->sortType] |= stage->attachedBins;
             }
 
             bytes += size;
@@ -86,19 +130,47 @@ namespace eigen
         }
 
         _validated = _end;
+        _compileDirty = true;
         _binMask = bins;
-        memcpy(_sortMasks, sortMasks, sizeof(_sortMasks));
         _count += stageCount;
 
         EIGEN_RETURN_OK();
     }
 
+    Error RenderPlan::setPerformanceKeyLayout(const PerformanceKeyLayout& layout)
+    {
+        unsigned totalBits = 0;
+        unsigned fieldsSeen = 0;
+        for (unsigned i = 0; i < PerformanceKeyLayout::FieldCount; i++)
+        {
+            if (layout.order[i] >= PerformanceKeyLayout::FieldCount || (fieldsSeen & (1 << layout.order[i])))
+            {
+                EIGEN_RETURN_ERROR("PerformanceKeyLayout order must list each field once (position %d)", (long)i);
+            }
+            if (layout.bits[i] > PerformanceKeyLayout::MaxFieldBits)
+            {
+                EIGEN_RETURN_ERROR("PerformanceKeyLayout field %d is wider than 32 bits", (long)i);
+            }
+            fieldsSeen |= 1 << layout.order[i];
+            totalBits += layout.bits[i];
+        }
+        if (totalBits > 64)
+        {
+            EIGEN_RETURN_ERROR("PerformanceKeyLayout needs %d bits, keys have 64", (long)totalBits);
+        }
+
+        _performanceKeyLayout = layout;
+        _compileDirty = true;
+
+        EIGEN_RETURN_OK();
+    }
+
     void RenderPlan::reset()
     {
         _binMask.clear();
-        memset(_sortMasks, 0, sizeof(_sortMasks));
         _end = _validated = _start;
         _count = 0;
+        _compileDirty = true;
     }
 
     void RenderPlan::reserve(uintptr_t bytes)
@@ -132,6 +204,15 @@ namespace eigen
 
     Error RenderPlan::validate()
     {
+        // Stages edited through the references add*Stage() returned no longer match the template, so
+        // they're validated and compiled again
+
+        if (!_compileDirty && memcmp((char*)_compiled + _compiled->stagesOffset, _start, (char*)_validated - (char*)_start) != 0)
+        {
+            _validated = _start;
+            _binMask.clear();
+        }
+
         while (_validated < _end)
         {
             if (_validated->targets == nullptr)
@@ -149,12 +230,226 @@ namespace eigen
                 {
                     EIGEN_RETURN_ERROR("BatchStage has invalid sort type", nullptr);
                 }
+                if (stage->depthBuckets == 0)
+                {
+                    EIGEN_RETURN_ERROR("BatchStage has no depth buckets", nullptr);
+                }
+                if (BucketSortsAnyBin(*stage) && stage->depthBuckets > MaxSortBuckets)
+                {
+                    EIGEN_RETURN_ERROR("BatchStage bucket sorts with more than %d depth buckets", (long)MaxSortBuckets);
+                }
                 _binMask |= stage->attachedBins;
-                _sortMasks[stage->sortType] |= stage->attachedBins;
             }
 
             _validated = _validated->advance();
+            _compileDirty = true;
+        }
+
+        if (_compileDirty)
+        {
+            return compile();
+        }
+
+        EIGEN_RETURN_OK();
+    }
+
+    Error RenderPlan::compile()
+    {
+        // Each batch stage adds at most one sort group plus a merge run per bin it draws, so
+        // gather them in a temporary array of that size and copy out what was used
+
+        unsigned batchStageCount = 0;
+        for (Stage* stage = _start; stage < _end; stage = stage->advance())
+        {
+            batchStageCount += stage->type == Stage::Type::Batch ? 1 : 0;
+        }
+
+        unsigned sortGroupCapacity = batchStageCount * (1 + MaxRenderBins);
+        SortGroup* sortGroups = AllocateMemory<SortGroup>(_manager->_allocator, sortGroupCapacity);
+        StageTemplate* stageTemplates = AllocateMemory<StageTemplate>(_manager->_allocator, _count);
+        if (sortGroups == nullptr || stageTemplates == nullptr)
+        {
+            FreeMemory(sortGroups);
+            FreeMemory(stageTemplates);
+            EIGEN_RETURN_ERROR("Out of memory compiling RenderPlan (%d stages)", (long)_count);
+        }
+
+        RenderBin::Set binMask;
+        RenderBin::Set performanceBins;
+        unsigned sortGroupCount = 0;
+
+        unsigned index = 0;
+        for (Stage* stage = _start; stage < _end; stage = stage->advance(), index++)
+        {
+            stageTemplates[index].stageOffset = (unsigned)((char*)stage - (char*)_start);
+            stageTemplates[index].sortGroup = -1;
+
+            if (stage->type != Stage::Type::Batch)
+            {
+                continue;
+            }
+
+            BatchStage* batchStage = (BatchStage*)stage;
+            binMask |= batchStage->attachedBins;
+            if (batchStage->sortType == BatchStage::SortType::Performance || batchStage->sortType == BatchStage::SortType::DepthBucketedPerformance)
+            {
+                performanceBins |= batchStage->attachedBins;
+            }
+
+            // Stages that draw the same bins in the same order share one sort
+
+            // A depth-sorted stage approximating all its bins is just a bucket sort
+
+            BatchStage::SortType sortType = batchStage->sortType;
+            RenderBin::Set approximateBins;
+            if (BatchStage::Approximated(sortType) != sortType)
+            {
+                approximateBins = batchStage->approximateBins;
+                approximateBins &= batchStage->attachedBins;
+                if (approximateBins == batchStage->attachedBins)
+                {
+                    sortType = BatchStage::Approximated(sortType);
+                    approximateBins.clear();
+                }
+            }
+
+            bool bucketed = sortType == BatchStage::SortType::DepthBucketedPerformance || BatchStage::IsApproximate(sortType) || !approximateBins.isEmpty();
+            uint16_t depthBuckets = bucketed ? batchStage->depthBuckets : 0;
+            bool coherent = batchStage->coherentSort && !BatchStage::IsApproximate(sortType);  // bucket sorting is linear already
+
+            unsigned group = 0;
+            for (; group < sortGroupCount; group++)
+            {
+                const SortGroup& candidate = sortGroups[group];
+                if (candidate.sortType == sortType && candidate.bins == batchStage->attachedBins && candidate.depthBuckets == depthBuckets && candidate.approximateBins == approximateBins)
+                {
+                    sortGroups[group].coherent |= coherent;
+                    break;
+                }
+            }
+
+            if (group == sortGroupCount)
+            {
+                SortGroup& sortGroup = sortGroups[sortGroupCount++];
+                sortGroup.bins = batchStage->attachedBins;
+                sortGroup.sortType = sortType;
+                sortGroup.binCount = 0;
+                sortGroup.runCount = 0;
+                sortGroup.coherent = coherent;
+                sortGroup.depthBuckets = depthBuckets;
+                sortGroup.approximateBins = approximateBins;
+
+                RenderBin::Set bins = batchStage->attachedBins;
+                bins.forEach(
+                    [&](unsigned position, const RenderBin::Set&)
+                    {
+                        sortGroup.binPositions[sortGroup.binCount++] = (uint8_t)position;
+                    }
+                );
+            }
+
+            stageTemplates[index].sortGroup = (int)group;
+        }
+        assert(index == _count);
+
+        // Turn unions into merges where some of their bins are sorted on their own anyway, or
+        // where some are bucket sorted and the rest exactly
+
+        unsigned stageGroupCount = sortGroupCount;
+        for (unsigned group = 0; group < stageGroupCount; group++)
+        {
+            SortGroup& sortGroup = sortGroups[group];
+            if (sortGroup.binCount < 2 || sortGroup.sortType == BatchStage::SortType::DepthBucketedPerformance)
+            {
+                continue;   // bucket bounds come from the whole group's depth range, so per-bin runs wouldn't agree
+            }
+
+            int runs[MaxRenderBins];
+            BatchStage::SortType runTypes[MaxRenderBins];
+            uint16_t runBuckets[MaxRenderBins];
+            bool anyRun = !sortGroup.approximateBins.isEmpty();
+            for (unsigned i = 0; i < sortGroup.binCount; i++)
+            {
+                bool approximate = sortGroup.approximateBins.test(sortGroup.binPositions[i]);
+                runTypes[i] = approximate ? BatchStage::Approximated(sortGroup.sortType) : sortGroup.sortType;
+                runBuckets[i] = approximate || BatchStage::IsApproximate(sortGroup.sortType) ? sortGroup.depthBuckets : 0;
+                runs[i] = FindRunGroup(sortGroups, stageGroupCount, sortGroup.binPositions[i], runTypes[i], runBuckets[i]);
+                anyRun |= runs[i] >= 0;
+            }
+
+            if (!anyRun)
+            {
+                continue;
+            }
+
+            for (unsigned i = 0; i < sortGroup.binCount; i++)
+            {
+                if (runs[i] < 0)
+                {
+                    runs[i] = FindRunGroup(sortGroups, sortGroupCount, sortGroup.binPositions[i], runTypes[i], runBuckets[i]);
+                }
+                if (runs[i] < 0)
+                {
+                    SortGroup& runGroup = sortGroups[sortGroupCount];
+                    runGroup.bins.clear();
+                    runGroup.bins.set(sortGroup.binPositions[i], true);
+                    runGroup.sortType = runTypes[i];
+                    runGroup.binCount = 1;
+                    runGroup.runCount = 0;
+                    runGroup.coherent = sortGroup.coherent && !BatchStage::IsApproximate(runTypes[i]);
+                    runGroup.depthBuckets = runBuckets[i];
+                    runGroup.approximateBins.clear();
+                    runGroup.binPositions[0] = sortGroup.binPositions[i];
+                    runs[i] = (int)sortGroupCount++;
+                }
+                sortGroup.runGroups[i] = (uint16_t)runs[i];
+            }
+            sortGroup.runCount = sortGroup.binCount;
+        }
+        assert(sortGroupCount <= sortGroupCapacity);
+
+        // Lay out the template
+
+        unsigned stagesBytes = (unsigned)((char*)_end - (char*)_start);
+        unsigned stageTemplatesOffset = sizeof(Compiled) + sizeof(SortGroup) * sortGroupCount;
+        unsigned stagesOffset = (stageTemplatesOffset + sizeof(StageTemplate) * _count + 15) & ~15;
+        unsigned bytes = stagesOffset + stagesBytes;
+
+        Compiled* compiled = (Compiled*)AllocateMemory<char>(_manager->_allocator, bytes);
+        if (compiled == nullptr)
+        {
+            FreeMemory(sortGroups);
+            FreeMemory(stageTemplates);
+            EIGEN_RETURN_ERROR("Out of memory compiling RenderPlan (%d bytes)", (long)bytes);
+        }
+
+        compiled->bytes = bytes;
+        compiled->serial = s_lastCompileSerial.fetch_add(1, std::memory_order_relaxed) + 1;
+        compiled->stageCount = _count;
+        compiled->sortGroupCount = sortGroupCount;
+        compiled->stageTemplatesOffset = stageTemplatesOffset;
+        compiled->stagesOffset = stagesOffset;
+        compiled->binMask = binMask;
+        compiled->performanceBins = performanceBins;
+        compiled->performanceKeyLayout = _performanceKeyLayout;
+        binMask.getRange(compiled->binRangeStart, compiled->binRangeEnd);
+
+        memcpy((void*)compiled->getSortGroups(), sortGroups, sizeof(SortGroup) * sortGroupCount);
+        memcpy((void*)compiled->getStageTemplates(), stageTemplates, sizeof(StageTemplate) * _count);
+        memcpy((char*)compiled + stagesOffset, _start, stagesBytes);
+
+        FreeMemory(sortGroups);
+        FreeMemory(stageTemplates);
+
+        // BatchQueues opened from the previous template may still be in flight
+
+        if (_compiled != nullptr)
+        {
+            Renderer& renderer = *StructFromMember(&Renderer::_planManager, _manager);
+            renderer.scheduleDeletion(_compiled, 1);
         }
+        _compiled = compiled;
+        _compileDirty = false;
 
         EIGEN_RETURN_OK();
     }
@@ -1,10 +1,13 @@
 #pragma once
 
 #include "Stage.h"
+#include "RenderBatch.h"
 
 namespace eigen
 {
 
+    class RenderPlanManager;
+
     ///////////////////////////////////////////////////////////////////////////////////////////
     //
     // RenderPlan
@@ -16,6 +19,9 @@ namespace eigen
     {
                                 friend class RenderPlanManager;
     public:
+                                struct SortGroup;
+                                struct StageTemplate;
+                                struct Compiled;
 
         void                    reserve(uintptr_t bytes);   // not required, pre-allocates space for stages
 
@@ -27,11 +33,15 @@ namespace eigen
 
         Error                   addStages(Stage** stages, unsigned stageCount);
 
+        Error                   setPerformanceKeyLayout(const PerformanceKeyLayout& layout);
+        const PerformanceKeyLayout& getPerformanceKeyLayout() const;
+
         unsigned                getStageCount() const;
 
-        Error                   validate();
+        Error                   validate();                 // also compiles the plan if stages were added or edited
 
         RenderPlanManager*      getManager() const;
+        const Compiled*         getCompiled() const;        // null until validate() succeeds
 
     protected:
                                 friend class BatchQueue;
@@ -40,18 +50,75 @@ namespace eigen
                                 RenderPlan();
                                 ~RenderPlan();
 
+        Error                   compile();
+
         RenderPlanManager*      _manager        = 0;
         RenderBin::Set          _binMask;
-        RenderBin::Set          _sortMasks[BatchStage::SortType::Count];
+        PerformanceKeyLayout    _performanceKeyLayout;
         Stage*                  _start          = 0;
         Stage*                  _end            = 0;
         Stage*                  _validated      = 0;
+        Compiled*               _compiled       = 0;
+        bool                    _compileDirty   = true;
         unsigned                _count          = 0;
         unsigned                _bytesCapacity  = 0;
     };
 
     typedef RefPtr<RenderPlan>  RenderPlanPtr;
 
+    ///////////////////////////////////////////////////////////////////////////////////////////
+    //
+    // RenderPlan::Compiled
+    //
+    // Execution template built from a validated plan: a copy of the stages, the distinct
+    // (bins, sort type) pairs they draw from, and which of those each stage uses. It's immutable
+    // once compiled, so BatchQueues share it rather than copying it. validate() compares it with
+    // the plan's stages, so edits made after compiling are picked up by the next queue opened. A
+    // template replaced by a recompile is deleted once the frames still using it are done.
+    //
+    // A group over several bins, some of which are also sorted on their own, is built by
+    // merging per-bin runs. Bins lacking a run get a group that no stage draws directly.
+    // The same goes for a depth-sorted stage that bucket sorts only some of its bins.
+    //
+
+    struct RenderPlan::SortGroup
+    {
+        RenderBin::Set          bins;
+        BatchStage::SortType    sortType;
+        unsigned                binCount;
+        unsigned                runCount;                       // nonzero if merged from per-bin groups instead of sorted
+        bool                    coherent;                       // some stage asked to reuse last frame's order
+        uint16_t                depthBuckets;                   // bucketed sort types, and groups with approximate bins
+        RenderBin::Set          approximateBins;                // bins merged in from bucket sorted runs
+        uint8_t                 binPositions[MaxRenderBins];
+        uint16_t                runGroups[MaxRenderBins];       // group holding each bin's sorted run, if merged
+    };
+
+    struct RenderPlan::StageTemplate
+    {
+        unsigned                stageOffset;        // bytes from getStages()
+        int                     sortGroup;          // -1 if the stage draws no batches
+    };
+
+    struct RenderPlan::Compiled
+    {
+        const SortGroup*        getSortGroups() const;
+        const StageTemplate*    getStageTemplates() const;
+        Stage*                  getStage(unsigned index) const;
+
+        unsigned                bytes;              // of the whole template
+        unsigned                serial;             // unique per compile, identifies the plan across frames
+        unsigned                stageCount;
+        unsigned                sortGroupCount;
+        unsigned                stageTemplatesOffset;
+        unsigned                stagesOffset;
+        unsigned                binRangeStart;
+        unsigned                binRangeEnd;
+        RenderBin::Set          binMask;
+        RenderBin::Set          performanceBins;    // bins some group sorts by state, so commits must build keys
+        PerformanceKeyLayout    performanceKeyLayout;
+    };
+
     ///////////////////////////////////////////////////////////////////////////////////////////
     //
     // RenderPlanManager
@@ -81,11 +148,37 @@ namespace eigen
         return _count;
     }
 
+    inline const PerformanceKeyLayout& RenderPlan::getPerformanceKeyLayout() const
+    {
+        return _performanceKeyLayout;
+    }
+
     inline RenderPlanManager* RenderPlan::getManager() const
     {
         return _manager;
     }
 
+    inline const RenderPlan::Compiled* RenderPlan::getCompiled() const
+    {
+        return _compileDirty ? nullptr : _compiled;
+    }
+
+    inline const RenderPlan::SortGroup* RenderPlan::Compiled::getSortGroups() const
+    {
+        return (const SortGroup*)(this + 1);
+    }
+
+    inline const RenderPlan::StageTemplate* RenderPlan::Compiled::getStageTemplates() const
+    {
+        return (const StageTemplate*)((const uint8_t*)this + stageTemplatesOffset);
+    }
+
+    inline Stage* RenderPlan::Compiled::getStage(unsigned index) const
+    {
+        assert(index < stageCount);
+        return (Stage*)((const uint8_t*)this + stagesOffset + getStageTemplates()[index].stageOffset);
+    }
+
     inline RenderPlanPtr RenderPlanManager::create()
     {
         RenderPlan* plan = new(AllocateMemory<RenderPlan>(&_planAllocator, 1)) RenderPlan();
@@ -93,7 +186,7 @@ namespace eigen
         return plan;
     }
 
-    inline ClearStage& RenderPlan::addClearStage(TargetSetPtr targets) throw()
+    inline ClearStage& RenderPlan::addClearStage(TargetSetPtr targets)
     {
         assert(targets.ptr != nullptr);
         reserve(sizeof(ClearStage));
@@ -104,7 +197,7 @@ namespace eigen
         return *stage;
     }
 
-    inline BatchStage& RenderPlan::addBatchStage(TargetSetPtr targets) throw()
+    inline BatchStage& RenderPlan::addBatchStage(TargetSetPtr targets)
     {
         assert(targets.ptr != nullptr);
         reserve(sizeof(BatchStage));
@@ -115,7 +208,7 @@ namespace eigen
         return *stage;
     }
 
-    inline FilterStage& RenderPlan::addFilterStage(TargetSetPtr targets) throw()
+    inline FilterStage& RenderPlan::addFilterStage(TargetSetPtr targets)
     {
         assert(targets.ptr != nullptr);
         reserve(sizeof(FilterStage));
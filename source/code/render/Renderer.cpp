@@ -9,14 +9,36 @@ namespace eigen
         _frameNumber = 1;
         _config = config;
 
-        _scratchMem = AllocateMemory<int8_t>(config.allocator, config.scratchSize);
-        _scratchAllocPtr = _scratchMem;
-        _scratchAllocEnd = _scratchMem + config.scratchSize/2;
+        // Inline dispatch has no threads to submit on, and finishes each frame before returning
+
+        if (config.inlineDispatch)
+        {
+            _config.submissionThreads = 1;
+            _config.framesInFlight = 1;
+        }
+
+        _config.framesInFlight = std::min(std::max(_config.framesInFlight, 1u), (unsigned)RenderDispatch::MaxFramesInFlight);
+        _config.scratchFrames = std::min(std::max(config.scratchFrames, _config.framesInFlight + 1), (unsigned)MaxScratchFrames);
+        _config.scratchPageSize = std::max(config.scratchPageSize, (unsigned)ScratchSliceSize);
+
+        // Reserve the initial pages up front, then let the first allocation pick one up
+
+        for (unsigned reserved = 0; reserved < config.scratchSize; reserved += _config.scratchPageSize)
+        {
+            if (!addScratchPage(_config.scratchPageSize))
+            {
+                EIGEN_RETURN_ERROR("Failed to reserve %d bytes of scratch memory", (long)config.scratchSize);
+            }
+        }
+        recycleScratchPages(_scratchFrameSlot);
+        _scratchAllocPtr = nullptr;
+        _scratchAllocEnd = nullptr;
 
         _deadMeat.initialize(config.allocator, 64);
         _binAgent.initialize(config.allocator, 2048);
         _planManager.initialize(config.allocator, 8);
-        return platformInit(config);    // see e.g. RendererDx11.cpp
+        _workCoordinator.initialize(config.allocator, _config.submissionThreads, _config.framesInFlight, config.handoffSpinCount, config.inlineDispatch);
+        return platformInit(_config);   // see e.g. RendererDx11.cpp
     }
 
     void Renderer::cleanup()
@@ -32,7 +54,17 @@ namespace eigen
             _deadMeat.removeFirst();
         }
 
-        FreeMemory(_scratchMem);
+        for (unsigned i = 0; i < MaxScratchFrames; i++)
+        {
+            recycleScratchPages(i);
+        }
+        while (_scratchFreePages)
+        {
+            ScratchPage* page = _scratchFreePages;
+            _scratchFreePages = page->next;
+            FreeMemory(page);
+        }
+
         platformCleanup();
         _frameNumber = 0;
     }
@@ -45,6 +77,95 @@ namespace eigen
         }
     }
 
+    int8_t* Renderer::scratchAllocSlow(uintptr_t bytes)
+    {
+        // Big requests would waste most of a slice, so they go straight to the shared arena
+
+        if (bytes > ScratchSliceSize/4)
+        {
+            return scratchAllocShared(bytes);
+        }
+
+        int8_t* slice = scratchAllocShared(ScratchSliceSize);
+        if (slice == nullptr)
+        {
+            return scratchAllocShared(bytes);   // the arena's tail may still fit this one
+        }
+
+        ScratchSegment& segment = ThreadScratchSegment();
+        segment.renderer = this;
+        segment.epoch = _scratchEpoch.load(std::memory_order_relaxed);
+        segment.ptr = slice + bytes;
+        segment.end = slice + ScratchSliceSize;
+        return slice;
+    }
+
+    int8_t* Renderer::scratchAllocShared(uintptr_t bytes)
+    {
+        bytes = (bytes + 15) & ~15;
+
+        _scratchLock.lock();
+
+        if (bytes > (uintptr_t)(_scratchAllocEnd - _scratchAllocPtr) && !addScratchPage(bytes))
+        {
+            _scratchLock.unlock();
+            return nullptr;     // out of memory
+        }
+
+        int8_t* p = _scratchAllocPtr;
+        _scratchAllocPtr += bytes;
+
+        _scratchLock.unlock();
+        return p;
+    }
+
+    bool Renderer::addScratchPage(uintptr_t bytes)
+    {
+        // Reuse a retired page if it's big enough, otherwise grow
+
+        ScratchPage* page = _scratchFreePages;
+        if (page && page->bytes >= bytes)
+        {
+            _scratchFreePages = page->next;
+        }
+        else
+        {
+            unsigned pageBytes = (unsigned)std::max(bytes, (uintptr_t)_config.scratchPageSize);
+            page = (ScratchPage*)AllocateMemory<int8_t>(_config.allocator, sizeof(ScratchPage) + pageBytes);
+            if (page == nullptr)
+            {
+                return false;
+            }
+            page->bytes = pageBytes;
+        }
+
+        page->next = _scratchFramePages[_scratchFrameSlot];
+        _scratchFramePages[_scratchFrameSlot] = page;
+
+        _scratchAllocPtr = page->getMemory();
+        _scratchAllocEnd = _scratchAllocPtr + page->bytes;
+        return true;
+    }
+
+    void Renderer::recycleScratchPages(unsigned frameSlot)
+    {
+        // Standard pages go back on the free list; oversized ones were one-offs, so release them
+
+        while (ScratchPage* page = _scratchFramePages[frameSlot])
+        {
+            _scratchFramePages[frameSlot] = page->next;
+            if (page->bytes == _config.scratchPageSize)
+            {
+                page->next = _scratchFreePages;
+                _scratchFreePages = page;
+            }
+            else
+            {
+                FreeMemory(page);
+            }
+        }
+    }
+
     RenderPlanPtr Renderer::createPlan()
     {
         return _planManager.create();
@@ -56,7 +177,7 @@ namespace eigen
         renderer.scheduleDeletion(plan, 1);
     }
 
-    BatchQueue* Renderer::openBatchQueue(RenderPlan* plan)
+    BatchQueue* Renderer::openBatchQueue(RenderPlan* plan, int priority)
     {
         if (Failed(plan->validate()))
         {
@@ -64,30 +185,111 @@ namespace eigen
         }
 
         BatchQueue* batchQ = BatchQueue::Create(this, plan);
-        batchQ->_next = _openBatchQueueHead;
-        _openBatchQueueHead = batchQ;
+        if (batchQ == nullptr)
+        {
+            return nullptr;
+        }
+        batchQ->_priority = priority;
+
+        // Lock-free push. Nothing is popped until the list is taken whole by collectBatchQueues(),
+        // so there's no ABA problem.
+
+        BatchQueue* head = _openedBatchQueues.load(std::memory_order_relaxed);
+        do
+        {
+            batchQ->_next = head;
+        }
+        while (!_openedBatchQueues.compare_exchange_weak(head, batchQ, std::memory_order_release, std::memory_order_relaxed));
+
         return batchQ;
     }
 
-    void Renderer::commenceWork()
+    Error Renderer::collectBatchQueues()
+    {
+        // Insert newly opened queues into submission order. There are only ever a few per frame.
+        // Queues breaking the ordering rules are still inserted, so none are lost.
+
+        bool priorityShared = false;
+        bool openedLate = false;
+
+        BatchQueue* opened = _openedBatchQueues.exchange(nullptr, std::memory_order_acquire);
+        while (opened)
+        {
+            BatchQueue* batchQ = opened;
+            opened = opened->_next;
+
+            BatchQueue** link = &_batchQueueHead;
+            while (*link && (*link)->_priority < batchQ->_priority)
+            {
+                link = &(*link)->_next;
+            }
+
+            priorityShared |= *link && (*link)->_priority == batchQ->_priority;     // order would depend on which thread opened first
+            openedLate |= *link && (*link)->_stagesDispatched > 0;                  // can't go before stages already dispatched
+
+            batchQ->_next = *link;
+            *link = batchQ;
+        }
+
+        if (priorityShared)
+        {
+            EIGEN_RETURN_ERROR("BatchQueues opened in the same frame must have different priorities", nullptr);
+        }
+        if (openedLate)
+        {
+            EIGEN_RETURN_ERROR("BatchQueue opened with a priority ahead of stages already commenced", nullptr);
+        }
+
+        EIGEN_RETURN_OK();
+    }
+
+    Error Renderer::commenceFinishedStages()
+    {
+        // Stages are submitted in order, so this only gets as far as the first stage still waiting
+        // on a bin. Rather than stall here while dispatch is behind, leave them to a later call.
+
+        Error error = collectBatchQueues();
+        if (Failed(error))
+        {
+            return error;
+        }
+
+        if (!_workCoordinator.trySync())
+        {
+            EIGEN_RETURN_OK();
+        }
+
+        if (_workCoordinator.prepareWork(_batchQueueHead, nullptr, 0, false) > 0)
+        {
+            _workCoordinator.kick();
+        }
+
+        EIGEN_RETURN_OK();
+    }
+
+    Error Renderer::commenceWork()
     {
+        Error error = collectBatchQueues();
+        if (Failed(error))
+        {
+            return error;
+        }
+
         // Ensure that no batchQs were left open
-        // Also reverse the open list to put it back into API order to aid debugging
 
-        BatchQueue* head = _openBatchQueueHead;
-        BatchQueue** tail = &head;
-        for (; _openBatchQueueHead; _openBatchQueueHead = _openBatchQueueHead->_next)
+        for (BatchQueue* batchQ = _batchQueueHead; batchQ; batchQ = batchQ->_next)
         {
-            if (_openBatchQueueHead->_renderer)
+            // finish() may be running on another thread, so ask under the lock it publishes with
+
+            batchQ->_finishLock.lock();
+            bool finished = batchQ->_plan->binMask.isSubsetOf(batchQ->_finishedBins);
+            batchQ->_finishLock.unlock();
+
+            if (!finished)
             {
-                // error TODO
-                assert(false);      // must call BatchQueue::finish() on all open batchQs before commencing work
-                return;
+                EIGEN_RETURN_ERROR("BatchQueue::finish() must be called on all open BatchQueues before commencing work", nullptr);
             }
-            *tail = _openBatchQueueHead;
-            tail = &(*tail)->_next;
         }
-        *tail = nullptr;
 
         //if (_frameNumber % 100 == 0)
         //{
@@ -95,29 +297,33 @@ namespace eigen
         //}
         _workCoordinator.sync();
 
-        _displayManager.presentAll(_frameNumber);
-
-        _workCoordinator.prepareWork(head);
-        _workCoordinator.kick();
+        // Displays are presented by the dispatch thread once the frame is submitted
 
-        if (_scratchAllocPtr > _scratchAllocEnd)
+        unsigned displayCount = _displayManager.getDisplayCount();
+        Display** displays = (Display**)scratchAlloc(sizeof(Display*) * displayCount);
+        for (unsigned i = 0; i < displayCount; i++)
         {
-            // TODO grow scratch buffer or spew error?
-            // note: must defer deallocation of current one until next frame if reallocting
+            displays[i] = _displayManager.getDisplay(i);
         }
 
-        // Toggle double-buffered frame alloc segment of scratch mem
+        // Whatever commenceFinishedStages() didn't already dispatch goes now, followed by presenting
 
-        if (_scratchAllocEnd == _scratchMem + _config.scratchSize/2)
-        {
-            _scratchAllocPtr  = _scratchAllocEnd;
-            _scratchAllocEnd += _config.scratchSize/2;
-        }
-        else
-        {
-            _scratchAllocPtr  = _scratchMem;
-            _scratchAllocEnd -= _config.scratchSize/2;
-        }
+        _workCoordinator.prepareWork(_batchQueueHead, displays, displayCount, true);
+        _workCoordinator.kick();
+
+        _batchQueueHead = nullptr;
+
+        // Move on to the next buffered frame's scratch pages. Their previous user is scratchFrames-1
+        // frames old, more than framesInFlight, so sync() has already waited for it to be dispatched.
+
+        _scratchLock.lock();
+        _scratchFrameSlot = (_scratchFrameSlot + 1) % _config.scratchFrames;
+        recycleScratchPages(_scratchFrameSlot);
+        _scratchAllocPtr = nullptr;
+        _scratchAllocEnd = nullptr;
+        _scratchLock.unlock();
+
+        _scratchEpoch.fetch_add(1, std::memory_order_relaxed);   // invalidates every thread's segment
 
         // Perform delayed destruction on resources
 
@@ -129,5 +335,19 @@ namespace eigen
         }
 
         _frameNumber++;
+
+        // Commits are done by now, so the count is complete
+
+        if (_droppedBatches.exchange(0, std::memory_order_relaxed) > 0)
+        {
+            EIGEN_RETURN_ERROR("Batches were dropped for lack of scratch memory", nullptr);
+        }
+
+        EIGEN_RETURN_OK();
+    }
+
+    void Renderer::waitForFrame(unsigned frameNumber)
+    {
+        _workCoordinator.waitForFrame(frameNumber);
     }
 }
@@ -5,6 +5,8 @@
 #include "core/RefCounted.h"
 #include "core/PodDeque.h"
 #include "core/Error.h"
+#include "core/SpinLock.h"
+#include "core/ThreadLocal.h"
 #include "BatchQueue.h"
 #include "RenderPlan.h"
 #include "Texture.h"
@@ -30,8 +32,13 @@ namespace eigen
         {
             Allocator*          allocator           = Mallocator::Get();
             bool                debugEnabled        = false;
-            unsigned            scratchSize         = 16*1024*1024;
+            unsigned            scratchSize         = 4*1024*1024;     // initial reservation, grows on demand
+            unsigned            scratchPageSize     = 1024*1024;
+            unsigned            scratchFrames       = 2;                // frames of scratch kept alive, 2..MaxScratchFrames, at least framesInFlight+1
             unsigned            submissionThreads   = 1;
+            unsigned            framesInFlight      = 1;                // frames commenceWork() may run ahead of submission, 1..3
+            unsigned            handoffSpinCount    = 0;                // spin before sleeping on frame handoff, for lowest latency
+            bool                inlineDispatch      = false;            // sort and submit within commenceWork(), with no threads at all
             PlatformConfig*     platformConfig      = nullptr;
         };
 
@@ -41,9 +48,19 @@ namespace eigen
         Error                   initialize(const Config& config);
         void                    cleanup();                      // Not required, but might help with tricky teardown issues
 
-        BatchQueue*             openBatchQueue(RenderPlan* plan); // Call this to begin rendering
+        // Call this to begin rendering, from any thread. Queues are submitted lowest priority first,
+        // and queues open in the same frame must have different priorities. The plan must already
+        // be validated if other threads might be opening it at the same time. Returns null if the
+        // plan is invalid or scratch memory is exhausted.
+        BatchQueue*             openBatchQueue(RenderPlan* plan, int priority = 0);
 
-        void                    commenceWork();
+        // Both fail without dispatching if a queue shares another's priority, was opened after stages it
+        // should precede were dispatched, or (commenceWork only) wasn't finished. Queues stay collected,
+        // so a later call submits them anyway. commenceWork also fails, after submitting the frame, if
+        // batches were dropped because scratch memory ran out.
+        Error                   commenceFinishedStages();       // dispatches stages whose bins are finished, see BatchQueue::finishBins()
+        Error                   commenceWork();
+        void                    waitForFrame(unsigned frameNumber);     // until that frame, already commenced, has been submitted
 
         RenderBin*              getBin(const char* name);
         unsigned                getFrameNumber() const;
@@ -67,6 +84,8 @@ namespace eigen
         friend void                 DestroyRefCounted(RenderPlan*);
 
         friend class                DisplayManager;
+        friend class                BatchQueue;                 // counts dropped batches
+        friend class                RenderPlan;                 // retires replaced templates
 
         struct DeadMeat
         {
@@ -75,13 +94,39 @@ namespace eigen
             unsigned                frameNumber;
         };
 
+        struct ScratchPage
+        {
+            ScratchPage*            next;
+            unsigned                bytes;                      // usable, not counting this header
+            unsigned                reserved[1];
+
+            int8_t*                 getMemory();
+        };
+
+        struct ScratchSegment                                   // per-thread slice of the frame's scratch memory
+        {
+            const Renderer*         renderer;
+            unsigned                epoch;
+            int8_t*                 ptr;
+            int8_t*                 end;
+        };
+
         Error                       platformInit(const Config& config);
         void                        platformCleanup();
 
                                     template<class T>
         void                        scheduleDeletion(T* obj, unsigned delay);
 
+        static ScratchSegment&      ThreadScratchSegment();
+        int8_t*                     scratchAllocSlow(uintptr_t bytes);
+        int8_t*                     scratchAllocShared(uintptr_t bytes);
+        bool                        addScratchPage(uintptr_t bytes);
+        void                        recycleScratchPages(unsigned frameSlot);
+        Error                       collectBatchQueues();
+
         enum {                      MaxBatchQueues = 12 };
+        enum {                      ScratchSliceSize = 64*1024 };
+        enum {                      MaxScratchFrames = 4 };
 
         Config                      _config;
 
@@ -93,12 +138,17 @@ namespace eigen
         SoftBitFlagAgent<RenderBin> _binAgent;
         PodDeque<DeadMeat>          _deadMeat;
 
-        int8_t*                     _scratchMem         = 0;
-
-        std::atomic<int8_t*>        _scratchAllocPtr    = 0;
+        SpinLock                    _scratchLock;                   // guards the page lists and alloc ptr/end
+        ScratchPage*                _scratchFreePages   = nullptr;
+        ScratchPage*                _scratchFramePages[MaxScratchFrames];   // in-use pages per buffered frame, newest first
+        unsigned                    _scratchFrameSlot   = 0;
+        int8_t*                     _scratchAllocPtr    = 0;
         int8_t*                     _scratchAllocEnd    = 0;
+        std::atomic<unsigned>       _scratchEpoch       = 0;    // bumped when the frame's scratch is switched
 
-        BatchQueue*                 _openBatchQueueHead   = nullptr;
+        std::atomic<BatchQueue*>    _openedBatchQueues  = nullptr;    // pushed by any thread, newest first
+        std::atomic<unsigned>       _droppedBatches     = 0;          // commits this frame that scratch memory couldn't hold
+        BatchQueue*                 _batchQueueHead     = nullptr;    // collected from the above, in submission order
         RenderDispatch              _workCoordinator;
 
         unsigned                    _frameNumber        = 0;
@@ -118,6 +168,7 @@ namespace eigen
     inline Renderer::Renderer()
         : _workCoordinator(*this)
     {
+        memset(_scratchFramePages, 0, sizeof(_scratchFramePages));
     }
 
     inline DisplayPtr Renderer::createDisplay()
@@ -126,7 +177,7 @@ namespace eigen
         return display;
     }
 
-    inline RenderBin* Renderer::getBin(const char* name) throw()
+    inline RenderBin* Renderer::getBin(const char* name)
     {
         return _binAgent.issue(name);
     }
@@ -136,14 +187,30 @@ namespace eigen
         return _frameNumber;
     }
 
+    inline Renderer::ScratchSegment& Renderer::ThreadScratchSegment()
+    {
+        static EIGEN_THREAD_LOCAL ScratchSegment segment;
+        return segment;
+    }
+
     inline int8_t* Renderer::scratchAlloc(uintptr_t bytes)
     {
-        int8_t* p = _scratchAllocPtr.fetch_add((bytes + 15) & ~15, std::memory_order_relaxed);  // p gets old value
-        if (p + bytes > _scratchAllocEnd)
+        // Common case touches only thread-local state, see scratchAllocSlow() for refilling
+
+        bytes = (bytes + 15) & ~15;
+        ScratchSegment& segment = ThreadScratchSegment();
+        if (segment.renderer == this && segment.epoch == _scratchEpoch.load(std::memory_order_relaxed) && segment.ptr + bytes <= segment.end)
         {
-            return nullptr;
+            int8_t* p = segment.ptr;
+            segment.ptr += bytes;
+            return p;
         }
-        return p;
+        return scratchAllocSlow(bytes);
+    }
+
+    inline int8_t* Renderer::ScratchPage::getMemory()
+    {
+        return (int8_t*)(this + 1);
     }
 
     template<class T> void Renderer::scheduleDeletion(T* obj, unsigned delay)
@@ -152,7 +219,7 @@ namespace eigen
         Renderer::DeadMeat& deadMeat = _deadMeat.addLast();
         deadMeat.object = obj;
         deadMeat.deleteFunc = (DeleteFunc)Delete<T>;
-        deadMeat.frameNumber = _frameNumber + delay;
+        deadMeat.frameNumber = _frameNumber + delay + _config.framesInFlight - 1;   // frames in flight may still use it
     }
 
     inline RenderPlanManager& Renderer::getPlanManager()
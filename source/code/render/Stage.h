@@ -79,14 +79,26 @@ namespace eigen
             Performance       = 0,
             IncreasingDepth,
             DecreasingDepth,
+            DepthBucketedPerformance,       // front-to-back depth buckets, state order within each
+            IncreasingDepthBuckets,         // approximate depth order in linear time, see BucketSort()
+            DecreasingDepthBuckets,
             Count
         };
                                 BatchStage();
 
         void                    attachBin(const RenderBin* bin);
 
+        static bool             IsBackToFront(SortType sortType);
+        static bool             IsApproximate(SortType sortType);
+        static bool             IsDepthOrder(SortType sortType);    // keyed on depth alone
+        static SortType         Reversed(SortType sortType);        // opposite depth order, or sortType if none
+        static SortType         Approximated(SortType sortType);    // bucket sorted equivalent, or sortType if none
+
         RenderBin::Set          attachedBins;
         SortType                sortType        = SortType::Performance;
+        bool                    coherentSort    = false;    // start from last frame's order, for slowly changing keys
+        uint16_t                depthBuckets    = 16;       // for bucketed sorts: slices of the bins' depth range
+        RenderBin::Set          approximateBins;            // of the attached bins, those to bucket sort despite exact depth order
     };
 
     ///////////////////////////////////////////////////////////////////////////////////////////
@@ -123,6 +135,43 @@ namespace eigen
         attachedBins |= bin->getBit();
     }
 
+    inline bool BatchStage::IsBackToFront(SortType sortType)
+    {
+        return sortType == SortType::DecreasingDepth || sortType == SortType::DecreasingDepthBuckets;
+    }
+
+    inline bool BatchStage::IsApproximate(SortType sortType)
+    {
+        return sortType == SortType::IncreasingDepthBuckets || sortType == SortType::DecreasingDepthBuckets;
+    }
+
+    inline bool BatchStage::IsDepthOrder(SortType sortType)
+    {
+        return Reversed(sortType) != sortType;
+    }
+
+    inline BatchStage::SortType BatchStage::Reversed(SortType sortType)
+    {
+        switch (sortType)
+        {
+        case SortType::IncreasingDepth:         return SortType::DecreasingDepth;
+        case SortType::DecreasingDepth:         return SortType::IncreasingDepth;
+        case SortType::IncreasingDepthBuckets:  return SortType::DecreasingDepthBuckets;
+        case SortType::DecreasingDepthBuckets:  return SortType::IncreasingDepthBuckets;
+        default:                                return sortType;
+        }
+    }
+
+    inline BatchStage::SortType BatchStage::Approximated(SortType sortType)
+    {
+        switch (sortType)
+        {
+        case SortType::IncreasingDepth:         return SortType::IncreasingDepthBuckets;
+        case SortType::DecreasingDepth:         return SortType::DecreasingDepthBuckets;
+        default:                                return sortType;
+        }
+    }
+
     inline FilterStage::FilterStage()
     {
         type = Type::Filter;
@@ -135,7 +184,7 @@ namespace eigen
         case Type::Clear:   return (ClearStage*)this + 1;
         case Type::Batch:   return (BatchStage*)this + 1;
         case Type::Filter:  return (FilterStage*)this + 1;
+        default:            return nullptr;
         }
-        return nullptr;
     }
 }
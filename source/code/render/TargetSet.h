@@ -1,6 +1,7 @@
 #pragma once
 
 #include "Texture.h"
+#include <cstring>
 
 namespace eigen
 {
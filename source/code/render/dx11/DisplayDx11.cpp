@@ -47,7 +47,7 @@ namespace eigen
         EIGEN_RETURN_OK();
     }
 
-    void Display::present()
+    void Display::present(unsigned frameNumber)
     {
         DisplayDx11* display = (DisplayDx11*)this;
         IDXGISwapChain* swapChain = display->_swapChain.Get();
@@ -12,57 +12,75 @@ namespace eigen
         return (D3D11_CLEAR_FLAG)result;
     }
 
-    void RenderDispatch::submitStageJob(unsigned context, const StageJob& stageJob)
+    void RenderDispatch::replayCommands(unsigned context, const CommandStream& commands)
     {
         Renderer::PlatformDetails& plat = _renderer.getPlatformDetails();
 
-        union
-        {
-            Stage*          stage;
-            ClearStage*     clearStage;
-            BatchStage*     batchStage;
-            FilterStage*    filterStage;
-        };
-
-        stage = stageJob.stage;
-
-        const TargetSetDx11* targets = (TargetSetDx11*)stage->targets;
+        ID3D11DeviceContext* ctx = plat.deferredContextCount ? plat.deferredContexts[context] : plat.immContext.Get();
 
-        switch (stageJob.stage->type)
+        for (const CommandStream::Command* command = commands.begin; command != commands.end; command = command->next())
         {
+            const void* const* operands = command->getOperands();
 
-        case Stage::Type::Clear:
+            switch (command->op)
+            {
 
-            if (Any(clearStage->flags & ClearStage::Flags::Depth_Stencil) && targets->_depthStencilView.Get())
+            case CommandStream::Op::Clear:
             {
-                plat.immContext->ClearDepthStencilView(targets->_depthStencilView.Get(), TranslateClearFlags(clearStage->flags), clearStage->depth, (UINT8)clearStage->stencil);
+                const ClearStage* clearStage = (const ClearStage*)operands[0];
+                const TargetSetDx11* targets = (TargetSetDx11*)clearStage->targets;
+
+                if (Any(clearStage->flags & ClearStage::Flags::Depth_Stencil) && targets->_depthStencilView.Get())
+                {
+                    ctx->ClearDepthStencilView(targets->_depthStencilView.Get(), TranslateClearFlags(clearStage->flags), clearStage->depth, (UINT8)clearStage->stencil);
+                }
+
+                for (unsigned i = 0; i < targets->getTextureCount() && targets->_targetViews[i].Get(); i++)
+                {
+                    ctx->ClearRenderTargetView(targets->_targetViews[i].Get(), (float*)(clearStage->colors + i));
+                }
+                break;
             }
 
-            for (unsigned i = 0; i < targets->getTextureCount() && targets->_targetViews[i].Get(); i++)
+            case CommandStream::Op::SetTargets:
             {
-                plat.immContext->ClearRenderTargetView(targets->_targetViews[i].Get(), (float*)(clearStage->colors + i));
+                const TargetSetDx11* targets = (const TargetSetDx11*)operands[0];
+
+                ctx->OMSetRenderTargets(targets->getTextureCount(), targets->_targetViews[0].GetAddressOf(), targets->_depthStencilView.Get());
+                // TODO - if UAVs present, OMSetRenderTargetsAndUnorderedAccessViews; if compute shader present, CSSetUnorderedAccessViews
+                break;
             }
 
-            return;
+            case CommandStream::Op::Draw:
 
-        case Stage::Type::Batch:
+                // TODO bind shader to context
 
-            plat.immContext->OMSetRenderTargets(targets->getTextureCount(), targets->_targetViews[0].GetAddressOf(), targets->_depthStencilView.Get());
-            // TODO - if UAVs present, OMSetRenderTargetsAndUnorderedAccessViews; if compute shader present, CSSetUnorderedAccessViews
+                for (unsigned i = 0; i < command->count; i++)
+                {
+                    (const RenderBatch*)operands[i];     // TODO
+                }
+                break;
 
-            // TODO bind shader to context
+            case CommandStream::Op::Filter:
 
-            for (unsigned i = stageJob.batchStart; i < stageJob.batchEnd; i++)
-            {
-                stageJob.batches[i];    // TODO
+                break;
             }
+        }
+    }
 
-            return;
-
-        case Stage::Type::Filter:
+    void RenderDispatch::executeContexts(unsigned contextCount)
+    {
+        Renderer::PlatformDetails& plat = _renderer.getPlatformDetails();
 
+        for (unsigned i = 0; i < contextCount; i++)
+        {
+            ID3D11CommandList* commandList = nullptr;
+            HRESULT hr = plat.deferredContexts[i]->FinishCommandList(FALSE, &commandList);
+            if (FAILED(hr))
+                continue;   // TODO report device removal
 
-            return;
+            plat.immContext->ExecuteCommandList(commandList, FALSE);
+            commandList->Release();
         }
     }
 
@@ -0,0 +1,143 @@
+#pragma once
+
+#include <cstdint>
+#include <cassert>
+
+namespace eigen
+{
+    class TargetSet;
+    class RenderBatch;
+    struct ClearStage;
+    struct FilterStage;
+
+    ///////////////////////////////////////////////////////////////////////////////////////////
+    //
+    // CommandStream
+    //
+    // What a run of StageJobs asks of the GPU, recorded by RenderDispatch without knowing the
+    // backend, and replayed into a context by the backend. Each command is an 8 byte header
+    // followed by its operands, all pointers, so a stream is read straight through with no
+    // decoding.
+    //
+    // CommandWriter drops SetTargets commands that would rebind the targets already bound.
+    //
+
+    struct CommandStream
+    {
+        enum class Op           : uint8_t
+        {
+            Clear               = 1,    // operand: ClearStage
+            SetTargets,                 // operand: TargetSet
+            Draw,                       // operands: RenderBatches, in order
+            Filter,                     // operand: FilterStage
+        };
+
+        struct Command
+        {
+            Op                  op;
+            uint32_t            count;      // operands following the header
+
+            const void* const*  getOperands() const;
+            const Command*      next() const;
+        };
+
+        static unsigned         GetBytes(unsigned commandCount, unsigned operandCount);
+
+        const Command*          begin   = nullptr;
+        const Command*          end     = nullptr;
+    };
+
+    class CommandWriter
+    {
+    public:
+                                CommandWriter(void* buffer, unsigned bytes);
+
+        void                    clear(const ClearStage* clearStage);
+        void                    setTargets(const TargetSet* targets);
+        void                    filter(const FilterStage* filterStage);
+        const void**            draw(unsigned batchCount);     // caller fills in the batches
+
+        CommandStream           getStream() const;
+
+    private:
+        const void**            write(CommandStream::Op op, unsigned count);
+
+        CommandStream::Command* _begin;
+        uint8_t*                _cursor;
+        uint8_t*                _end;
+        const TargetSet*        _boundTargets   = nullptr;
+    };
+
+    ///////////////////////////////////////////////////////////////////////////////////////////
+    ///////////////////////////////////////////////////////////////////////////////////////////
+
+    static_assert(sizeof(CommandStream::Command) == 8, "CommandStream::Command should stay packed to one word");
+
+    inline const void* const* CommandStream::Command::getOperands() const
+    {
+        return (const void* const*)(this + 1);
+    }
+
+    inline const CommandStream::Command* CommandStream::Command::next() const
+    {
+        return (const Command*)(getOperands() + count);
+    }
+
+    inline unsigned CommandStream::GetBytes(unsigned commandCount, unsigned operandCount)
+    {
+        return commandCount * sizeof(Command) + operandCount * sizeof(void*);
+    }
+
+    inline CommandWriter::CommandWriter(void* buffer, unsigned bytes)
+        : _begin((CommandStream::Command*)buffer)
+        , _cursor((uint8_t*)buffer)
+        , _end((uint8_t*)buffer + bytes)
+    {
+        assert(((uintptr_t)buffer & (sizeof(void*)-1)) == 0);
+    }
+
+    inline const void** CommandWriter::write(CommandStream::Op op, unsigned count)
+    {
+        assert(_cursor + CommandStream::GetBytes(1, count) <= _end);   // buffer sized too small
+
+        CommandStream::Command* command = (CommandStream::Command*)_cursor;
+        command->op = op;
+        command->count = count;
+        _cursor += CommandStream::GetBytes(1, count);
+
+        return (const void**)(command + 1);
+    }
+
+    inline void CommandWriter::clear(const ClearStage* clearStage)
+    {
+        write(CommandStream::Op::Clear, 1)[0] = clearStage;
+    }
+
+    inline void CommandWriter::setTargets(const TargetSet* targets)
+    {
+        if (targets != _boundTargets)
+        {
+            write(CommandStream::Op::SetTargets, 1)[0] = targets;
+            _boundTargets = targets;
+        }
+    }
+
+    inline void CommandWriter::filter(const FilterStage* filterStage)
+    {
+        write(CommandStream::Op::Filter, 1)[0] = filterStage;
+    }
+
+    inline const void** CommandWriter::draw(unsigned batchCount)
+    {
+        return write(CommandStream::Op::Draw, batchCount);
+    }
+
+    inline CommandStream CommandWriter::getStream() const
+    {
+        CommandStream stream;
+        stream.begin = _begin;
+        stream.end = (const CommandStream::Command*)_cursor;
+        return stream;
+    }
+
+}
@@ -17,12 +17,13 @@ namespace eigen
         platformInit(allocator);
     }
 
-    void DisplayManager::presentAll(unsigned frameNumber)
+    void DisplayManager::PresentAll(Display* const* displays, unsigned count, unsigned frameNumber)
     {
-        for (unsigned i = 0; i < _displays.getCount(); i++)
+        // Called on the dispatch thread with the displays registered when the frame was prepared
+
+        for (unsigned i = 0; i < count; i++)
         {
-            Display* display = _displays.at(i);
-            display->present();     // TODO only present dirty displays
+            displays[i]->present(frameNumber);     // TODO only present dirty displays
         }
     }
 
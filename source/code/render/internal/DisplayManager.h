@@ -22,7 +22,10 @@ namespace eigen
         Display*            createDisplay();
         void                unregisterDisplay(Display* display);
 
-        void                presentAll(unsigned frameNumber);
+        unsigned            getDisplayCount() const;
+        Display*            getDisplay(unsigned i) const;
+
+        static void         PresentAll(Display* const* displays, unsigned count, unsigned frameNumber);
 
     private:
 
@@ -34,5 +37,17 @@ namespace eigen
         PodArray<Display*>  _displays;
     };
 
+    ///////////////////////////////////////////////////////////////////////////////////////////
+    ///////////////////////////////////////////////////////////////////////////////////////////
+
+    inline unsigned DisplayManager::getDisplayCount() const
+    {
+        return _displays.getCount();
+    }
+
+    inline Display* DisplayManager::getDisplay(unsigned i) const
+    {
+        return _displays.at(i);
+    }
 
 }
@@ -0,0 +1,241 @@
+#include "JobPool.h"
+#include "core/math.h"
+#include "core/SpinLock.h"
+#include "core/ThreadLocal.h"
+#include <thread>
+#include <condition_variable>
+#include <mutex>
+
+namespace eigen
+{
+    static EIGEN_THREAD_LOCAL unsigned t_dequeIndex = 0;           // pool threads use their own deque, others share 0
+
+    struct JobPool::Deque
+    {
+        bool pushBack(Job* job)
+        {
+            spinLock.lock();
+            bool full = (back - front) > mask;
+            if (!full)
+            {
+                jobs[back++ & mask] = job;
+            }
+            spinLock.unlock();
+            return !full;
+        }
+
+        Job* popBack()
+        {
+            Job* job = nullptr;
+            spinLock.lock();
+            if (back != front)
+            {
+                job = jobs[--back & mask];
+            }
+            spinLock.unlock();
+            return job;
+        }
+
+        Job* popFront()
+        {
+            Job* job = nullptr;
+            spinLock.lock();
+            if (back != front)
+            {
+                job = jobs[front++ & mask];
+            }
+            spinLock.unlock();
+            return job;
+        }
+
+        SpinLock            spinLock;
+        Job**               jobs;
+        unsigned            mask;
+        unsigned            front;
+        unsigned            back;
+        char                padding[64];                        // keep neighbouring deques off this cache line
+    };
+
+    struct JobPool::Worker
+    {
+        std::thread         thread;
+    };
+
+    struct JobPoolWake
+    {
+        std::mutex                  mutex;
+        std::condition_variable     condition;
+    };
+
+    JobPool::JobPool()
+    {
+        static_assert(sizeof(JobPoolWake) <= sizeof(_wakeSpace), "Must increase size of JobPool::_wakeSpace");
+        new(&_wakeSpace) JobPoolWake();
+        _queued.store(0, std::memory_order_relaxed);
+        _sleeping.store(0, std::memory_order_relaxed);
+        _stopRequested.store(false, std::memory_order_relaxed);
+    }
+
+    JobPool::~JobPool()
+    {
+        stop();
+        ((JobPoolWake&)_wakeSpace).~JobPoolWake();
+    }
+
+    void JobPool::initialize(Allocator* allocator, unsigned threadCount, unsigned dequeCapacity)
+    {
+        assert(_deques == nullptr);     // already initialized
+        assert(threadCount > 0);
+
+        _allocator = allocator;
+        _threadCount = threadCount;
+
+        unsigned capacity = FloodBitsRight((uint32_t)dequeCapacity - 1) + 1;
+
+        _deques = AllocateMemory<Deque>(allocator, threadCount);
+        for (unsigned i = 0; i < threadCount; i++)
+        {
+            Deque& deque = *new(_deques + i) Deque;
+            deque.jobs = AllocateMemory<Job*>(allocator, capacity);
+            deque.mask = capacity - 1;
+            deque.front = 0;
+            deque.back = 0;
+        }
+
+        // Deque 0 belongs to whichever thread calls helpUntilDone(), so only threadCount-1 are spawned
+
+        _workers = AllocateMemory<Worker>(allocator, threadCount);
+        for (unsigned i = 1; i < threadCount; i++)
+        {
+            new(&_workers[i].thread) std::thread(Run, this, i);
+        }
+    }
+
+    void JobPool::stop()
+    {
+        if (_deques == nullptr)
+        {
+            return;
+        }
+
+        {
+            JobPoolWake& wake = (JobPoolWake&)_wakeSpace;
+            std::lock_guard<std::mutex> lock(wake.mutex);
+            _stopRequested.store(true, std::memory_order_relaxed);
+            wake.condition.notify_all();
+        }
+
+        for (unsigned i = 1; i < _threadCount; i++)
+        {
+            _workers[i].thread.join();
+            _workers[i].thread.~thread();
+        }
+        FreeMemory(_workers);
+
+        for (unsigned i = 0; i < _threadCount; i++)
+        {
+            FreeMemory(_deques[i].jobs);
+        }
+        FreeMemory(_deques);
+
+        _deques = nullptr;
+        _workers = nullptr;
+        _threadCount = 1;
+    }
+
+    void JobPool::submit(Job* job)
+    {
+        Deque& deque = _deques[t_dequeIndex];
+        if (!deque.pushBack(job))
+        {
+            Execute(job);       // deque is full, no harm in running it right here
+            return;
+        }
+
+        // seq_cst on both sides: either the sleeper sees the job, or we see the sleeper
+
+        _queued.fetch_add(1);
+
+        if (_sleeping.load() > 0)
+        {
+            JobPoolWake& wake = (JobPoolWake&)_wakeSpace;
+            std::lock_guard<std::mutex> lock(wake.mutex);
+            wake.condition.notify_one();
+        }
+    }
+
+    void JobPool::Execute(Job* job)
+    {
+        std::atomic<int>* pending = job->pending;
+        job->run(job);
+        if (pending)
+        {
+            pending->fetch_sub(1, std::memory_order_acq_rel);
+        }
+    }
+
+    bool JobPool::runOne(unsigned index)
+    {
+        Job* job = _deques[index].popBack();
+
+        for (unsigned i = 1; job == nullptr && i < _threadCount; i++)
+        {
+            unsigned victim = index + i;
+            victim -= victim >= _threadCount ? _threadCount : 0;
+            job = _deques[victim].popFront();
+        }
+
+        if (job == nullptr)
+        {
+            return false;
+        }
+
+        _queued.fetch_sub(1, std::memory_order_relaxed);
+        Execute(job);
+        return true;
+    }
+
+    void JobPool::helpUntilDone(std::atomic<int>& pending)
+    {
+        unsigned index = t_dequeIndex;
+
+        while (pending.load(std::memory_order_acquire) > 0)
+        {
+            if (!runOne(index))
+            {
+                std::this_thread::yield();  // remaining jobs are in flight on other threads
+            }
+        }
+    }
+
+    void JobPool::Run(JobPool* pool, unsigned index)
+    {
+        t_dequeIndex = index;
+
+        JobPoolWake& wake = (JobPoolWake&)pool->_wakeSpace;
+
+        while (true)
+        {
+            if (pool->runOne(index))
+            {
+                continue;
+            }
+
+            std::unique_lock<std::mutex> lock(wake.mutex);
+
+            pool->_sleeping.fetch_add(1);
+            wake.condition.wait(lock, [pool]()
+                {
+                    return pool->_stopRequested.load(std::memory_order_relaxed) || pool->_queued.load() > 0;
+                }
+            );
+            pool->_sleeping.fetch_sub(1, std::memory_order_relaxed);
+
+            if (pool->_stopRequested.load(std::memory_order_relaxed))
+            {
+                return;
+            }
+        }
+    }
+
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+#include "core/memory.h"
+#include <atomic>
+
+namespace eigen
+{
+
+    ///////////////////////////////////////////////////////////////////////////////////////////
+    //
+    // JobPool
+    //
+    // Worker threads, each owning a deque of jobs. A thread pushes and pops at the back of its
+    // own deque; idle threads steal from the front of the others. Threads that don't belong to
+    // the pool share deque 0, and help drain it while they wait.
+    //
+
+    class JobPool
+    {
+    public:
+
+        struct Job
+        {
+            void                    (*run)(Job* job);
+            std::atomic<int>*       pending;        // decremented after run() returns, may be null
+        };
+
+                                    JobPool();
+                                    ~JobPool();
+
+        void                        initialize(Allocator* allocator, unsigned threadCount, unsigned dequeCapacity);
+        void                        stop();
+
+        unsigned                    getThreadCount() const;     // pool threads plus one for the helping thread
+
+        void                        submit(Job* job);
+        void                        helpUntilDone(std::atomic<int>& pending);
+
+    private:
+                                    struct Deque;
+                                    struct Worker;
+
+        static void                 Run(JobPool* pool, unsigned index);
+
+        bool                        runOne(unsigned index);
+        static void                 Execute(Job* job);
+
+        Allocator*                  _allocator      = nullptr;
+        Deque*                      _deques         = nullptr;
+        Worker*                     _workers        = nullptr;
+        unsigned                    _threadCount    = 1;
+
+        void*                       _wakeSpace[16];             // std::mutex + std::condition_variable
+        std::atomic<int>            _queued;
+        std::atomic<int>            _sleeping;
+        std::atomic<bool>           _stopRequested;
+    };
+
+    ///////////////////////////////////////////////////////////////////////////////////////////
+    ///////////////////////////////////////////////////////////////////////////////////////////
+
+    inline unsigned JobPool::getThreadCount() const
+    {
+        return _threadCount;
+    }
+
+}
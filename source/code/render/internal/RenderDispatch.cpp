@@ -1,10 +1,15 @@
 #include "../Renderer.h"
+#include "core/sort.h"
+#include "core/Semaphore.h"
+#include <cfloat>
 #include <thread>
-#include <condition_variable>
-#include <mutex>
 
 namespace eigen
 {
+    // The game thread hands prepared frames to the dispatch thread through a ring of up to
+    // framesInFlight entries, and frameDone is signaled as each is submitted. A null frame tells the
+    // dispatch thread to exit.
+
     struct RenderDispatch::Thread
     {
         static void Run(RenderDispatch* coordinator)
@@ -12,33 +17,159 @@ namespace eigen
             coordinator->asyncRun();
         }
 
-        Thread(RenderDispatch* coordinator)
-            : stopRequested(false)
-            , mutex()
-            , thread(Run, coordinator)
+        Thread()
+            : kicked(0)
+            , taken(0)
+            , retired(0)
+            , lastFrameKicked(~0u)
+            , lastFrameRetired(~0u)
+            , framesInFlight(1)
+            , spinCount(0)
         {
         }
 
-        bool                    stopRequested;
-        std::mutex              mutex;
-        std::thread             thread;
+        Semaphore               frameReady;
+        Semaphore               frameDone;
+        FrameWork*              handoffs[MaxFramesInFlight];    // written before frameReady is signaled
+        unsigned                kicked;             // game thread: frames handed off
+        unsigned                taken;              // dispatch thread: frames taken from the ring
+        unsigned                retired;            // game thread: frameDone signals consumed
+        unsigned                kickedFrames[MaxFramesInFlight];    // game thread: frame numbers, same slots as handoffs
+        bool                    kickedEnds[MaxFramesInFlight];      // game thread: packet is its frame's last, same slots
+        unsigned                lastFrameKicked;    // game thread: frame whose last packet was kicked most recently
+        unsigned                lastFrameRetired;   // game thread: same, once it has been submitted
+        unsigned                framesInFlight;     // set before the first kick
+        std::atomic<unsigned>   spinCount;          // before sleeping on either semaphore
+        std::thread             thread;             // started by initialize(), unless dispatching inline
+
+        void retire()   // after consuming a frameDone signal
+        {
+            unsigned slot = retired++ % MaxFramesInFlight;
+            if (kickedEnds[slot])
+            {
+                lastFrameRetired = kickedFrames[slot];
+            }
+        }
     };
 
     struct RenderDispatch::SortJob
     {
+        JobPool::Job            job;                // must be first
         SortJob*                next;
         BatchQueue*             batchQ;
-        BatchStage::SortType    sortType;
-        BatchQueue::CachedSort  cachedSort;
+        const RenderPlan::SortGroup* sortGroup;
+        BatchQueue::CachedSort  cachedSort;         // the gathered array, or the leader's result when shared
+        void*                   gathered;           // SortBatch records, or CompactSortBatch if compact
+        void*                   scratch;            // radix sort ping-pong buffer, null for small jobs
+        RenderBatch**           batchTable;         // compact only, the batches records refer to
+        SortJob*                leader;             // earlier job that gathered identical input, or null
+        bool                    compact;            // depth keyed, so 8 byte records will do
+        bool                    parallel;           // big enough to be split across the pool, see parallelSort()
+
+        unsigned                occurrence;         // among queues opened on the same plan this frame
+        SortHistory*            history;            // coherent sorts only, see seedFromHistory()
+        unsigned                historyCount;       // entries the seeding buffers below were sized for
+        struct HistoryRank*     ranks;
+        unsigned                rankMask;
+        void*                   slots;
+
+        enum {                  InsertionSortMax = 32 };
 
-        void execute();
+        static void RunGather(JobPool::Job* job);
+        static void RunSort(JobPool::Job* job);
+        static void RunMerge(JobPool::Job* job);
+        void gather();
+        void findDepthRange(float& depthMin, float& inverseSpan) const;
+        void sort();
+        void merge();
+        void recordHistory();
+        void setResult(void* records);
+        unsigned getRecordSize() const;
+        bool isMerge() const;
+        bool hasSameInput(const SortJob& other) const;
+
+        template<class Record> void gatherRecords();
+        template<class Record> void sortRecords();
+        template<class Record> void bucketSort();
+        template<class Record> void seedFromHistory();
+        template<class Record> void mergeRecords();
+    };
+
+    // A sort group's order from the last frame it was drawn, by batch identity
+
+    struct RenderDispatch::SortHistory
+    {
+        unsigned                planSerial;
+        unsigned                group;
+        unsigned                occurrence;         // among queues opened on the same plan this frame
+        unsigned                lastFrame;
+        const RenderBatch**     order;
+        unsigned                count;
+        unsigned                capacity;
     };
 
+    // One slice of a parallel radix sort
+
+    struct RenderDispatch::SortPart
+    {
+        JobPool::Job            job;                // must be first
+        const void*             src;
+        void*                   dst;
+        unsigned                begin;
+        unsigned                end;
+        unsigned                pass;
+        uint64_t                keyAnd;
+        uint64_t                keyOr;
+        unsigned                digits[RadixDigits];    // counts of the slice's digits, then where each goes in dst
+
+        template<class Record> static void RunKeyBits(JobPool::Job* job);
+        template<class Record> static void RunCount(JobPool::Job* job);
+        template<class Record> static void RunScatter(JobPool::Job* job);
+    };
+
+    // One submission context's share of the frame's stage jobs, recorded to a CommandStream and
+    // replayed on a pool thread
+
+    struct RenderDispatch::SubmitJob
+    {
+        JobPool::Job            job;                // must be first
+        RenderDispatch*         dispatch;
+        unsigned                context;
+        const StageJob*         begin;
+        const StageJob*         end;
+        void*                   commands;
+        unsigned                commandBytes;       // enough for every stage job to set its targets
+
+        static void Run(JobPool::Job* job);
+    };
+
+    enum {                      ParallelSortMin = 32*1024 };   // smaller groups are sorted on one thread
+    enum {                      MaxSortParts = 16 };
+
+    struct HistoryRank
+    {
+        const RenderBatch*      batch;
+        unsigned                rank;
+    };
+
+    enum {                      SortHistoryFrames = 2 };    // histories not drawn for longer are dropped
+
+    // Submission cost is counted in draws. Each stage job also pays for binding its targets.
+
+    enum {                      StageJobCost = 64 };
+    enum {                      ContextCostMin = 4*1024 };  // less work than this isn't worth another context
+    enum {                      SplitBatchesMin = 256 };    // batch ranges are not split into smaller pieces
+
+    inline unsigned HashBatch(const RenderBatch* batch)
+    {
+        return (unsigned)(((uintptr_t)batch >> 4) * 2654435761u);
+    }
+
     RenderDispatch::RenderDispatch(Renderer& renderer)
         : _renderer(renderer)
     {
         static_assert(sizeof(Thread) <= sizeof(_threadSpace), "Must increaase size of RenderDispatch::_threadSpace");
-        new(&_threadSpace) Thread(this);
+        new(&_threadSpace) Thread();
     }
 
     RenderDispatch::~RenderDispatch()
@@ -46,8 +177,33 @@ namespace eigen
         stop();
     }
 
-    void RenderDispatch::initialize(Allocator* allocator, unsigned submissionThreads)
+    void RenderDispatch::initialize(Allocator* allocator, unsigned submissionThreads, unsigned framesInFlight, unsigned handoffSpinCount, bool inlineDispatch)
     {
+        assert(framesInFlight >= 1 && framesInFlight <= MaxFramesInFlight);
+        assert(!inlineDispatch || (submissionThreads <= 1 && framesInFlight == 1));
+
+        Thread& thread = getThread();
+        thread.framesInFlight = framesInFlight;
+        thread.spinCount.store(handoffSpinCount, std::memory_order_relaxed);
+
+        // The dispatch thread (or the caller, inline) helps with its own jobs, so it counts as one of the pool's threads
+
+        _jobPool.initialize(allocator, std::max(submissionThreads, 1u), 1024);
+
+        // Backends create a deferred context per submission thread when there's more than one
+
+        _contextCount = std::max(submissionThreads, 1u);
+
+        _allocator = allocator;
+        _sortHistories.initialize(allocator, 16);
+
+        // Inline, commenceWork() runs each frame itself, so there's no dispatch thread at all
+
+        _inline = inlineDispatch;
+        if (!_inline)
+        {
+            thread.thread = std::thread(Thread::Run, this);
+        }
     }
 
     void RenderDispatch::asyncRun()
@@ -56,22 +212,271 @@ namespace eigen
 
         while (true)
         {
-            std::unique_lock<std::mutex> lock(thread.mutex);
+            thread.frameReady.wait(thread.spinCount.load(std::memory_order_relaxed));
+
+            FrameWork* frame = thread.handoffs[thread.taken++ % MaxFramesInFlight];
+            if (frame == nullptr)
+                return;     // stop requested
+
+            runFrame(*frame);
+
+            thread.frameDone.signal();
+        }
+    }
+
+    void RenderDispatch::runFrame(FrameWork& frame)
+    {
+        _frameNumber = frame.frameNumber;
+
+        attachSortHistories(frame);
+
+        // Sort jobs are independent of each other, so spread them across the pool. Gathering
+        // first lets jobs with identical input (e.g. split-screen queues sharing a shadow bin)
+        // be sorted once.
+
+        if (frame.sortJobCount > 0)
+        {
+            runSortJobs(frame, SortJob::RunGather);
+            shareSortResults(frame);
+            runSortJobs(frame, SortJob::RunSort);
+
+            // Groups too big for one thread are then sorted one at a time by the whole pool
+
+            for (SortJob* job = frame.sortJobHead; job; job = job->next)
+            {
+                if (job->parallel && !job->leader)
+                {
+                    if (job->compact)
+                        parallelSort<BatchQueue::CompactSortBatch>(job);
+                    else
+                        parallelSort<BatchQueue::SortBatch>(job);
+                }
+            }
+
+            for (SortJob* job = frame.sortJobHead; job; job = job->next)
+            {
+                if (job->leader)
+                {
+                    job->cachedSort = job->leader->cachedSort;
+                    if (job->history)
+                    {
+                        job->recordHistory();
+                    }
+                }
+            }
+
+            // Bin unions are merged from the per-bin results sorted above
+
+            runSortJobs(frame, SortJob::RunMerge);
+        }
+
+        // Issue batches
+
+        submitStageJobs(frame);
+
+        DisplayManager::PresentAll(frame.displays, frame.displayCount, frame.frameNumber);
+    }
+
+    void RenderDispatch::submitStageJobs(FrameWork& frame)
+    {
+        if (_contextCount == 1)
+        {
+            SubmitJob::Run(&frame.submitJobs[0].job);
+            return;
+        }
+
+        // Each context is recorded on its own thread, then the contexts are executed in plan order
+
+        std::atomic<int> pending(0);
+
+        for (unsigned i = 1; i < frame.submitJobCount; i++)
+        {
+            pending.fetch_add(1, std::memory_order_relaxed);
+            frame.submitJobs[i].job.pending = &pending;
+            _jobPool.submit(&frame.submitJobs[i].job);
+        }
+
+        SubmitJob::Run(&frame.submitJobs[0].job);
+        _jobPool.helpUntilDone(pending);
+
+        executeContexts(frame.submitJobCount);
+    }
+
+    void RenderDispatch::runSortJobs(FrameWork& frame, void (*run)(JobPool::Job*))
+    {
+        // Merge jobs only take part in the merge, and jobs that share a leader's result or are sorted
+        // in parallel sit out the sort
+
+        bool merging = run == SortJob::RunMerge;
+        bool sorting = run == SortJob::RunSort;
+        std::atomic<int> pending(0);
+
+        for (SortJob* job = frame.sortJobHead; job; job = job->next)
+        {
+            if (job->isMerge() != merging || (sorting && (job->leader || job->parallel)))
+            {
+                continue;
+            }
+
+            pending.fetch_add(1, std::memory_order_relaxed);
+            job->job.run = run;
+            job->job.pending = &pending;
+            _jobPool.submit(&job->job);
+        }
+
+        _jobPool.helpUntilDone(pending);
+    }
+
+    void RenderDispatch::runSortParts(SortPart* parts, unsigned partCount, void (*run)(JobPool::Job*))
+    {
+        std::atomic<int> pending(partCount);
+
+        for (unsigned i = 0; i < partCount; i++)
+        {
+            parts[i].job.run = run;
+            parts[i].job.pending = &pending;
+            _jobPool.submit(&parts[i].job);
+        }
+
+        _jobPool.helpUntilDone(pending);
+    }
+
+    template<class Record> void RenderDispatch::parallelSort(SortJob* job)
+    {
+        // LSD radix sort with every pass split into slices: slices count their digits, a prefix sum
+        // over (digit, slice) gives each slice its own output ranges, then slices scatter at once.
+        // Slices are contiguous and ranked in order within each digit, so the sort stays stable.
+
+        unsigned count = job->cachedSort.count;
+        unsigned partCount = std::min(_jobPool.getThreadCount(), (unsigned)MaxSortParts);
+
+        SortPart parts[MaxSortParts];
+        for (unsigned i = 0; i < partCount; i++)
+        {
+            parts[i].src = job->gathered;
+            parts[i].begin = (unsigned)((uint64_t)count * i / partCount);
+            parts[i].end = (unsigned)((uint64_t)count * (i+1) / partCount);
+        }
+
+        // Digits that are the same for every key need no pass (e.g. the upper half of depth keys)
+
+        runSortParts(parts, partCount, SortPart::RunKeyBits<Record>);
+
+        uint64_t keyAnd = ~0ull;
+        uint64_t keyOr = 0;
+        for (unsigned i = 0; i < partCount; i++)
+        {
+            keyAnd &= parts[i].keyAnd;
+            keyOr |= parts[i].keyOr;
+        }
+        uint64_t varyingBits = keyAnd ^ keyOr;
+
+        Record* src = (Record*)job->gathered;
+        Record* dst = (Record*)job->scratch;
+
+        for (unsigned pass = 0; pass < sizeof(src->sortKey); pass++)
+        {
+            if (((varyingBits >> (pass*8)) & 0xff) == 0)
+            {
+                continue;
+            }
+
+            for (unsigned i = 0; i < partCount; i++)
+            {
+                parts[i].src = src;
+                parts[i].dst = dst;
+                parts[i].pass = pass;
+            }
+
+            runSortParts(parts, partCount, SortPart::RunCount<Record>);
+
+            unsigned offset = 0;
+            for (unsigned digit = 0; digit < RadixDigits; digit++)
+            {
+                for (unsigned i = 0; i < partCount; i++)
+                {
+                    unsigned n = parts[i].digits[digit];
+                    parts[i].digits[digit] = offset;
+                    offset += n;
+                }
+            }
+
+            runSortParts(parts, partCount, SortPart::RunScatter<Record>);
+
+            Record* swap = src;
+            src = dst;
+            dst = swap;
+        }
+
+        // Whichever buffer ended up sorted is the result, no copy back needed
+
+        job->setResult(src);
+
+        if (job->history)
+        {
+            job->recordHistory();
+        }
+    }
+
+    template<class Record> void RenderDispatch::SortPart::RunKeyBits(JobPool::Job* job)
+    {
+        SortPart& part = *(SortPart*)job;
+        const Record* src = (const Record*)part.src;
+        uint64_t keyAnd = ~0ull;
+        uint64_t keyOr = 0;
+        for (unsigned i = part.begin; i < part.end; i++)
+        {
+            keyAnd &= src[i].sortKey;
+            keyOr |= src[i].sortKey;
+        }
+        part.keyAnd = keyAnd;
+        part.keyOr = keyOr;
+    }
+
+    template<class Record> void RenderDispatch::SortPart::RunCount(JobPool::Job* job)
+    {
+        SortPart& part = *(SortPart*)job;
+        memset(part.digits, 0, sizeof(part.digits));
+        RadixCount((const Record*)part.src + part.begin, part.end - part.begin, part.pass, part.digits);
+    }
+
+    template<class Record> void RenderDispatch::SortPart::RunScatter(JobPool::Job* job)
+    {
+        SortPart& part = *(SortPart*)job;
+        RadixScatter((const Record*)part.src + part.begin, (Record*)part.dst, part.end - part.begin, part.pass, part.digits);
+    }
+
+    void RenderDispatch::shareSortResults(FrameWork& frame)
+    {
+        // Open-addressed on (bins, sort type, buckets, count), then confirmed by comparing gathered
+        // input, so colliding keys and same-sized but different contents never share a result
 
-            if (thread.stopRequested)
-                return;
+        memset(frame.sortShareTable, 0, sizeof(SortJob*) * (frame.sortShareMask+1));
 
-            // TODO no concurrent sort job issuing yet
-            for (SortJob* job = _sortJobHead; job; job = job->next)
+        for (SortJob* job = frame.sortJobHead; job; job = job->next)
+        {
+            if (job->isMerge())
             {
-                job->execute();
+                continue;
             }
 
-            // Issue batches
+            const RenderPlan::SortGroup* sortGroup = job->sortGroup;
+            unsigned hash = sortGroup->bins.hash() ^ ((unsigned)sortGroup->sortType * 0x9e3779b9u) ^ job->cachedSort.count
+                ^ ((unsigned)sortGroup->depthBuckets * 0x85ebca6bu) ^ (sortGroup->approximateBins.hash() << 1);
 
-            for (unsigned i = 0; i < _stageJobCount; i++)
+            for (unsigned i = hash & frame.sortShareMask; ; i = (i+1) & frame.sortShareMask)
             {
-                submitStageJob(0, _stageJobs[i]);
+                SortJob* other = frame.sortShareTable[i];
+                if (other == nullptr)
+                {
+                    frame.sortShareTable[i] = job;
+                    break;
+                }
+                if (job->hasSameInput(*other))
+                {
+                    job->leader = other;
+                    break;
+                }
             }
         }
     }
@@ -80,173 +485,887 @@ namespace eigen
     {
         Thread& thread = getThread();
 
-        thread.mutex.lock();
-        _head = nullptr;
+        // Wait for the oldest frame to be submitted if the pipeline is full
+
+        if (thread.kicked - thread.retired == thread.framesInFlight)
+        {
+            thread.frameDone.wait(thread.spinCount.load(std::memory_order_relaxed));
+            thread.retire();
+        }
+    }
+
+    bool RenderDispatch::trySync()
+    {
+        Thread& thread = getThread();
+
+        if (thread.kicked - thread.retired == thread.framesInFlight)
+        {
+            if (!thread.frameDone.tryWait())
+            {
+                return false;
+            }
+            thread.retire();
+        }
+        return true;
+    }
+
+    void RenderDispatch::waitForFrame(unsigned frameNumber)
+    {
+        // Inline, frames are submitted before commenceWork() returns
+
+        if (_inline)
+        {
+            return;
+        }
+
+        Thread& thread = getThread();
+
+        // Only a frame's last packet completes it. That packet is kicked by the same thread that waits here,
+        // so it must already be on its way.
+
+        assert((int)(thread.lastFrameKicked - frameNumber) >= 0);     // frame hasn't been commenced
+
+        while ((int)(thread.lastFrameRetired - frameNumber) < 0)
+        {
+            thread.frameDone.wait(thread.spinCount.load(std::memory_order_relaxed));
+            thread.retire();
+        }
     }
 
-    inline RenderDispatch::SortJob* RenderDispatch::createSortJob(BatchQueue* batchQ, unsigned count)
+    inline RenderDispatch::SortJob* RenderDispatch::createSortJob(BatchQueue* batchQ, const RenderPlan::SortGroup* sortGroup, unsigned count, unsigned occurrence)
     {
-        unsigned bytes = sizeof(SortJob) + sizeof(BatchQueue::SortBatch) * count;
+        bool needsScratch = sortGroup->runCount == 0 && count > SortJob::InsertionSortMax;
+
+        // Depth keys are 32 bits, so those records carry an index into a batch table instead of a pointer
+
+        bool compact = BatchStage::IsDepthOrder(sortGroup->sortType);
+        unsigned recordSize = compact ? sizeof(BatchQueue::CompactSortBatch) : sizeof(BatchQueue::SortBatch);
+
+        unsigned gatheredBytes = recordSize * count;
+        unsigned scratchBytes = needsScratch ? recordSize * count : 0;
+        unsigned batchTableBytes = compact ? sizeof(RenderBatch*) * count : 0;
+
+        unsigned bytes = sizeof(SortJob) + gatheredBytes + scratchBytes + batchTableBytes;
         SortJob* job = (SortJob*)_renderer.scratchAlloc(bytes);
+        uint8_t* space = (uint8_t*)(job + 1);
 
+        job->job.run = SortJob::RunGather;
+        job->job.pending = nullptr;
         job->next = nullptr;
         job->batchQ = batchQ;
+        job->sortGroup = sortGroup;
+        job->occurrence = occurrence;
+        job->gathered = space;
+        job->scratch = needsScratch ? space + gatheredBytes : nullptr;
+        job->batchTable = compact ? (RenderBatch**)(space + gatheredBytes + scratchBytes) : nullptr;
+        job->compact = compact;
         job->cachedSort.count = count;
-        job->cachedSort.batches = (BatchQueue::SortBatch*)(job + 1);
+        job->setResult(job->gathered);
+        job->leader = nullptr;
+        job->parallel = needsScratch && !BatchStage::IsApproximate(sortGroup->sortType) && count >= ParallelSortMin && _jobPool.getThreadCount() > 1;
+        job->history = nullptr;     // see attachSortHistories()
+        job->historyCount = 0;
+        job->ranks = nullptr;
+        job->rankMask = 0;
+        job->slots = nullptr;
 
         return job;
     }
 
-    void RenderDispatch::addBatchQueueJobs(BatchQueue* batchQ, SortJob**& sortJobTail, StageJob*& stageJobEnd)
+    void RenderDispatch::attachSortHistories(FrameWork& frame)
     {
-        unsigned submissionCost = 0;
+        // Histories belong to the dispatch thread, since frames in flight may be prepared while
+        // earlier ones are still being sorted
 
-        Stage* stage = batchQ->_stages;
-        for (unsigned stageCount = batchQ->_stagesCount; stageCount > 0; stageCount--, stage = stage->advance())
+        retireSortHistories(false);
+
+        for (SortJob* job = frame.sortJobHead; job; job = job->next)
         {
-            stage->targets->_touch(_renderer.getFrameNumber());
+            const RenderPlan::SortGroup* sortGroup = job->sortGroup;
+            if (!sortGroup->coherent || sortGroup->runCount > 0)
+            {
+                continue;
+            }
 
-            stageJobEnd->stage = stage;
-            stageJobEnd->batches = nullptr;
-            stageJobEnd->batchStart = 0;
-            stageJobEnd->batchEnd = 0;
+            const RenderPlan::Compiled* plan = job->batchQ->_plan;
+            unsigned group = (unsigned)(sortGroup - plan->getSortGroups());
+            unsigned count = job->cachedSort.count;
+            job->history = findSortHistory(plan->serial, group, job->occurrence, count);
 
-            BatchStage* batchStage;
+            // Seeding from history needs a rank lookup and a slot per batch in last frame's order
 
-            switch (stage->type)
+            if (job->scratch == nullptr || job->history->count == 0)
             {
-            case Stage::Type::Clear:
-                stageJobEnd++;
-                continue;
-            case Stage::Type::Batch:
-                batchStage = (BatchStage*)stage;
-                break;
-            case Stage::Type::Filter:
-                submissionCost++;
-                stageJobEnd++;
                 continue;
-            default:
-                assert(false);  // batchQ is corrupt
-                return;
             }
 
-            bool isDepthSort = (batchStage->sortType == BatchStage::SortType::IncreasingDepth || batchStage->sortType == BatchStage::SortType::DecreasingDepth);
+            job->historyCount = job->history->count;
+            job->rankMask = FloodBitsRight(job->historyCount * 2);
 
-            unsigned count = 0;
-            batchStage->attachedBins.forEach(
-                [&](unsigned binIndex, const RenderBin::Set& )
-                {
-                    count += batchQ->_batchLists[binIndex].count;
-                }
-            );
+            unsigned slotsBytes = job->getRecordSize() * job->historyCount;
+            unsigned ranksBytes = sizeof(HistoryRank) * (job->rankMask+1);
+            uint8_t* space = (uint8_t*)_renderer.scratchAlloc(slotsBytes + ranksBytes);
 
-            if (count == 0)
-                continue;
+            job->slots = space;
+            job->ranks = (HistoryRank*)(space + slotsBytes);
+            job->parallel = false;      // AdaptiveSort runs on one thread
+        }
+    }
+
+    const BatchQueue::CachedSort* RenderDispatch::addSortJob(FrameWork& frame, BatchQueue* batchQ, unsigned group, unsigned occurrence, SortJob**& sortJobTail, unsigned& count)
+    {
+        // The group's bins are finished, so counting again gives the same answer even if it was
+        // sorted by an earlier packet, whose result the dispatch thread may still be writing
 
-            submissionCost += count;
+        const RenderPlan::SortGroup& sortGroup = batchQ->_plan->getSortGroups()[group];
 
-            BatchQueue::SortCacheEntry& sortCacheEntry = isDepthSort ? batchQ->findCachedDepthSort(batchStage->attachedBins) : batchQ->findCachedPerfSort(batchStage->attachedBins);
-            if (sortCacheEntry.cached == nullptr)
-            {
-                SortJob* job = createSortJob(batchQ, count);
-                job->sortType = isDepthSort ? BatchStage::SortType::IncreasingDepth : BatchStage::SortType::Performance;
-                job->cachedSort.binMask = batchStage->attachedBins;
+        count = 0;
+        for (unsigned i = 0; i < sortGroup.binCount; i++)
+        {
+            count += batchQ->_batchLists[sortGroup.binPositions[i]].getCount();
+        }
+
+        if (count == 0 || batchQ->_sortResults[group])
+        {
+            return batchQ->_sortResults[group];
+        }
+
+        // A merge reads the sorted runs of its bins, so those are sorted first (or already were)
+
+        for (unsigned i = 0; i < sortGroup.runCount; i++)
+        {
+            unsigned runCount;
+            addSortJob(frame, batchQ, sortGroup.runGroups[i], occurrence, sortJobTail, runCount);
+        }
 
-                sortCacheEntry.cached = &job->cachedSort;
+        SortJob* job = createSortJob(batchQ, &sortGroup, count, occurrence);
 
-                *sortJobTail = job;
-                sortJobTail = &job->next;
+        batchQ->_sortResults[group] = &job->cachedSort;
+
+        *sortJobTail = job;
+        sortJobTail = &job->next;
+        frame.sortJobCount++;
+
+        return &job->cachedSort;
+    }
+
+    bool RenderDispatch::addBatchQueueJobs(FrameWork& frame, BatchQueue* batchQ, unsigned occurrence, SortJob**& sortJobTail, StageJob*& stageJobEnd)
+    {
+        const RenderPlan::Compiled* plan = batchQ->_plan;
+        const RenderPlan::SortGroup* sortGroups = plan->getSortGroups();
+
+        batchQ->_finishLock.lock();
+        RenderBin::Set finishedBins = batchQ->_finishedBins;
+        batchQ->_finishLock.unlock();
+
+        // Instantiate stage jobs from the templates, up to the first stage drawing a bin that's still
+        // open. Batch stages with nothing to draw are left out. There's one sort per distinct (bins,
+        // sort type) pair, however many stages draw it.
+
+        const RenderPlan::StageTemplate* stageTemplates = plan->getStageTemplates();
+        unsigned i = batchQ->_stagesDispatched;
+        for (; i < plan->stageCount; i++)
+        {
+            int group = stageTemplates[i].sortGroup;
+            if (group >= 0 && !sortGroups[group].bins.isSubsetOf(finishedBins))
+                break;
+
+            Stage* stage = plan->getStage(i);
+            stage->targets->_touch(_renderer.getFrameNumber());
+
+            const BatchQueue::CachedSort* sorted = nullptr;
+            unsigned count = 0;
+            if (group >= 0)
+            {
+                sorted = addSortJob(frame, batchQ, (unsigned)group, occurrence, sortJobTail, count);
+                if (sorted == nullptr)
+                    continue;
             }
-            assert(sortCacheEntry.cached->binMask == batchStage->attachedBins && sortCacheEntry.cached->count == count);
 
-            stageJobEnd->batches = sortCacheEntry.cached->batches;
+            stageJobEnd->stage = stage;
+            stageJobEnd->sorted = sorted;
             stageJobEnd->batchStart = 0;
-            stageJobEnd->batchEnd = sortCacheEntry.cached->count;
+            stageJobEnd->batchEnd = count;
             stageJobEnd++;
         }
+
+        batchQ->_stagesDispatched = i;
+        return i == plan->stageCount;
     }
 
-    void RenderDispatch::prepareWork(BatchQueue* head)
+    unsigned RenderDispatch::prepareWork(BatchQueue* head, Display* const* displays, unsigned displayCount, bool endsFrame)
     {
-        assert(_head == nullptr);
-        _head = head;
+        FrameWork& frame = *(FrameWork*)_renderer.scratchAlloc(sizeof(FrameWork));
+        frame.frameNumber = _renderer.getFrameNumber();
+        frame.head = head;
+        frame.displays = displays;
+        frame.displayCount = displayCount;
+        frame.endsFrame = endsFrame;
 
-        // Count total stages across all batchQs
+        // Count stages not yet dispatched across all batchQs, an upper bound on stage jobs
 
-        _stageJobCount = 0;
-        for (BatchQueue* batchQ = _head; batchQ; batchQ = batchQ->_next)
+        frame.stageJobCount = 0;
+        for (BatchQueue* batchQ = head; batchQ; batchQ = batchQ->_next)
         {
-            _stageJobCount += batchQ->_stagesCount;
+            frame.stageJobCount += batchQ->_plan->stageCount - batchQ->_stagesDispatched;
         }
 
         // Populate sort jobs and stage jobs
 
-        _sortJobHead = nullptr;
-        SortJob** sortJobTail = &_sortJobHead;
+        frame.sortJobHead = nullptr;
+        frame.sortJobCount = 0;
+        SortJob** sortJobTail = &frame.sortJobHead;
+
+        frame.stageJobs = (StageJob*)_renderer.scratchAlloc(sizeof(StageJob) * frame.stageJobCount);
+        StageJob* stageJobEnd = frame.stageJobs;
+
+        for (BatchQueue* batchQ = head; batchQ; batchQ = batchQ->_next)
+        {
+            // Queues opened on the same plan are told apart by the order they were opened in
+
+            unsigned occurrence = 0;
+            for (BatchQueue* earlier = head; earlier != batchQ; earlier = earlier->_next)
+            {
+                occurrence += earlier->_plan->serial == batchQ->_plan->serial ? 1 : 0;
+            }
+
+            // Later queues draw after this one, so they wait for all of its stages
+
+            if (!addBatchQueueJobs(frame, batchQ, occurrence, sortJobTail, stageJobEnd))
+                break;
+        }
+
+        frame.stageJobCount = (unsigned)(stageJobEnd - frame.stageJobs);    // empty batch stages were skipped
+
+        partitionStageJobs(frame);
+
+        frame.sortShareMask = FloodBitsRight(frame.sortJobCount * 2);
+        frame.sortShareTable = (SortJob**)_renderer.scratchAlloc(sizeof(SortJob*) * (frame.sortShareMask+1));
+
+        _frame = &frame;
+        return frame.stageJobCount;
+    }
+
+    void RenderDispatch::partitionStageJobs(FrameWork& frame)
+    {
+        uint64_t totalCost = 0;
+        for (unsigned i = 0; i < frame.stageJobCount; i++)
+        {
+            totalCost += StageJobCost + frame.stageJobs[i].batchEnd - frame.stageJobs[i].batchStart;
+        }
+
+        unsigned contextCount = (unsigned)std::min<uint64_t>(_contextCount, std::max<uint64_t>(totalCost / ContextCostMin, 1));
+        uint64_t target = (totalCost + contextCount - 1) / contextCount;
+
+        // Contexts take consecutive stage jobs until they reach their share of the cost. A batch
+        // range that overshoots is split, so stage jobs are rebuilt with room for a split per context.
+
+        StageJob* stageJobs = (StageJob*)_renderer.scratchAlloc(sizeof(StageJob) * (frame.stageJobCount + contextCount - 1));
+        StageJob* stageJobEnd = stageJobs;
+
+        frame.submitJobs = (SubmitJob*)_renderer.scratchAlloc(sizeof(SubmitJob) * contextCount);
+        SubmitJob* submitJob = frame.submitJobs;
+        submitJob->begin = stageJobs;
+        uint64_t spent = 0;
+
+        auto closeContext = [&]()
+        {
+            submitJob->end = stageJobEnd;
+            submitJob++;
+            submitJob->begin = stageJobEnd;
+            spent = 0;
+        };
+
+        for (unsigned i = 0; i < frame.stageJobCount; i++)
+        {
+            StageJob piece = frame.stageJobs[i];
+
+            while (true)
+            {
+                unsigned batches = piece.batchEnd - piece.batchStart;
+                uint64_t cost = StageJobCost + batches;
+                bool lastContext = submitJob == frame.submitJobs + contextCount - 1;
+
+                if (lastContext || spent + cost <= target)
+                {
+                    *stageJobEnd++ = piece;
+                    spent += cost;
+                    if (spent == target && !lastContext)
+                    {
+                        closeContext();
+                    }
+                    break;
+                }
+
+                // Overshoots the share: fill the rest of it with the front of the range if both
+                // pieces are worth drawing separately, otherwise keep or pass on the whole job
+
+                uint64_t room = target - spent;
+
+                if (room >= StageJobCost + SplitBatchesMin && batches >= room - StageJobCost + SplitBatchesMin)
+                {
+                    StageJob& front = *stageJobEnd++;
+                    front = piece;
+                    front.batchEnd = piece.batchStart + (unsigned)(room - StageJobCost);
+                    piece.batchStart = front.batchEnd;
+                    closeContext();
+                    continue;
+                }
+
+                if (spent == 0 || room*2 >= cost)
+                {
+                    *stageJobEnd++ = piece;
+                    closeContext();
+                    break;
+                }
+
+                closeContext();
+            }
+        }
 
-        _stageJobs = (StageJob*)_renderer.scratchAlloc(sizeof(StageJob) * _stageJobCount);
-        StageJob* stageJobEnd = _stageJobs;
+        submitJob->end = stageJobEnd;
+        frame.submitJobCount = (unsigned)(submitJob - frame.submitJobs) + 1;
 
-        for (BatchQueue* batchQ = _head; batchQ; batchQ = batchQ->_next)
+        // Worst case for a stage job is setting targets plus one other command
+
+        for (unsigned i = 0; i < frame.submitJobCount; i++)
         {
-            addBatchQueueJobs(batchQ, sortJobTail, stageJobEnd);
+            SubmitJob& job = frame.submitJobs[i];
+            job.job.run = SubmitJob::Run;
+            job.job.pending = nullptr;
+            job.dispatch = this;
+            job.context = i;
+
+            unsigned stageJobCount = (unsigned)(job.end - job.begin);
+            unsigned batchCount = 0;
+            for (const StageJob* stageJob = job.begin; stageJob != job.end; stageJob++)
+            {
+                batchCount += stageJob->batchEnd - stageJob->batchStart;
+            }
+
+            job.commandBytes = CommandStream::GetBytes(stageJobCount*2, stageJobCount*2 + batchCount);
+            job.commands = _renderer.scratchAlloc(job.commandBytes);
         }
+
+        frame.stageJobs = stageJobs;
+        frame.stageJobCount = (unsigned)(stageJobEnd - stageJobs);
     }
 
     void RenderDispatch::kick()
     {
+        // Inline, the frame is sorted and submitted right here, so there is never one in flight
+
+        if (_inline)
+        {
+            runFrame(*_frame);
+            return;
+        }
+
         Thread& thread = getThread();
 
-        thread.mutex.unlock();
+        assert(thread.kicked - thread.retired < thread.framesInFlight);    // must sync() first
+
+        unsigned slot = thread.kicked++ % MaxFramesInFlight;
+        thread.handoffs[slot] = _frame;
+        thread.kickedFrames[slot] = _frame->frameNumber;
+        thread.kickedEnds[slot] = _frame->endsFrame;
+        if (_frame->endsFrame)
+        {
+            thread.lastFrameKicked = _frame->frameNumber;
+        }
+        thread.frameReady.signal();
     }
 
     void RenderDispatch::stop()
     {
         Thread& thread = getThread();
 
-        sync();
+        while (thread.kicked != thread.retired)
+        {
+            thread.frameDone.wait(thread.spinCount.load(std::memory_order_relaxed));
+            thread.retire();
+        }
 
-        thread.stopRequested = true;
+        if (thread.thread.joinable())   // already stopped if not
+        {
+            thread.handoffs[thread.kicked % MaxFramesInFlight] = nullptr;
+            thread.frameReady.signal();
+            thread.thread.join();
+        }
 
-        kick();
+        _jobPool.stop();
 
-        if (thread.thread.joinable())   // TODO seems sketchy, fixes shutdown problem
-            thread.thread.join();
+        retireSortHistories(true);
+    }
+
+    RenderDispatch::SortHistory* RenderDispatch::findSortHistory(unsigned planSerial, unsigned group, unsigned occurrence, unsigned count)
+    {
+        // Called on the dispatch thread before the frame's sorts run, so histories can be created and grown here
+
+        SortHistory* history = nullptr;
+        for (unsigned i = 0; i < _sortHistories.getCount(); i++)
+        {
+            SortHistory* candidate = _sortHistories.at(i);
+            if (candidate->planSerial == planSerial && candidate->group == group && candidate->occurrence == occurrence)
+            {
+                history = candidate;
+                break;
+            }
+        }
+
+        if (history == nullptr)
+        {
+            history = AllocateMemory<SortHistory>(_allocator, 1);
+            history->planSerial = planSerial;
+            history->group = group;
+            history->occurrence = occurrence;
+            history->order = nullptr;
+            history->count = 0;
+            history->capacity = 0;
+            _sortHistories.addLast() = history;
+        }
+
+        if (history->capacity < count)
+        {
+            unsigned capacity = std::max(count, history->capacity * 2);
+            const RenderBatch** order = AllocateMemory<const RenderBatch*>(_allocator, capacity);
+            if (history->order != nullptr)
+            {
+                memcpy(order, history->order, sizeof(const RenderBatch*) * history->count);
+                FreeMemory(history->order);
+            }
+            history->order = order;
+            history->capacity = capacity;
+        }
+
+        history->lastFrame = _frameNumber;
+        return history;
+    }
+
+    void RenderDispatch::retireSortHistories(bool all)
+    {
+        // Plans that were recompiled or released stop refreshing their histories, and age out here
+
+        for (unsigned i = _sortHistories.getCount(); i-- > 0;)
+        {
+            SortHistory* history = _sortHistories.at(i);
+            if (all || _frameNumber - history->lastFrame > SortHistoryFrames)
+            {
+                FreeMemory(history->order);
+                FreeMemory(history);
+                _sortHistories.remove(i);
+            }
+        }
+    }
+
+    void RenderDispatch::SubmitJob::Run(JobPool::Job* job)
+    {
+        SubmitJob* submitJob = (SubmitJob*)job;
+
+        CommandWriter writer(submitJob->commands, submitJob->commandBytes);
+        for (const StageJob* stageJob = submitJob->begin; stageJob != submitJob->end; stageJob++)
+        {
+            submitJob->dispatch->recordStageJob(writer, *stageJob);
+        }
+
+        submitJob->dispatch->replayCommands(submitJob->context, writer.getStream());
+    }
+
+    void RenderDispatch::recordStageJob(CommandWriter& writer, const StageJob& stageJob)
+    {
+        Stage* stage = stageJob.stage;
+
+        switch (stage->type)
+        {
+
+        case Stage::Type::Clear:
+
+            writer.clear((ClearStage*)stage);
+            return;
+
+        case Stage::Type::Batch:
+        {
+            writer.setTargets(stage->targets);
+
+            const void** batches = writer.draw(stageJob.batchEnd - stageJob.batchStart);
+            for (unsigned i = stageJob.batchStart; i < stageJob.batchEnd; i++)
+            {
+                *batches++ = stageJob.sorted->getBatch(i);
+            }
+            return;
+        }
+
+        case Stage::Type::Filter:
+
+            writer.setTargets(stage->targets);
+            writer.filter((FilterStage*)stage);
+            return;
+
+        default:
+
+            assert(false);      // plans only compile stages of known types
+            return;
+        }
+    }
+
+    void RenderDispatch::SortJob::RunGather(JobPool::Job* job)
+    {
+        ((SortJob*)job)->gather();
+    }
+
+    void RenderDispatch::SortJob::RunSort(JobPool::Job* job)
+    {
+        ((SortJob*)job)->sort();
+    }
+
+    void RenderDispatch::SortJob::RunMerge(JobPool::Job* job)
+    {
+        ((SortJob*)job)->merge();
+    }
+
+    inline bool RenderDispatch::SortJob::isMerge() const
+    {
+        return sortGroup->runCount > 0;
+    }
+
+    inline unsigned RenderDispatch::SortJob::getRecordSize() const
+    {
+        return compact ? sizeof(BatchQueue::CompactSortBatch) : sizeof(BatchQueue::SortBatch);
+    }
+
+    inline void RenderDispatch::SortJob::setResult(void* records)
+    {
+        cachedSort.records = records;
+        cachedSort.batchTable = compact ? batchTable : nullptr;
+    }
+
+    bool RenderDispatch::SortJob::hasSameInput(const SortJob& other) const
+    {
+        // Compact records are just positions, so for those the batches are compared separately. Bucketed
+        // groups gather plain depth records, so their bucketing has to match as well.
+
+        return sortGroup->sortType == other.sortGroup->sortType
+            && sortGroup->bins == other.sortGroup->bins
+            && sortGroup->depthBuckets == other.sortGroup->depthBuckets
+            && sortGroup->approximateBins == other.sortGroup->approximateBins
+            && cachedSort.count == other.cachedSort.count
+            && memcmp(gathered, other.gathered, getRecordSize() * cachedSort.count) == 0
+            && (!compact || memcmp(batchTable, other.batchTable, sizeof(RenderBatch*) * cachedSort.count) == 0);
+    }
+
+    void RenderDispatch::SortJob::findDepthRange(float& depthMin, float& inverseSpan) const
+    {
+        float low = FLT_MAX;
+        float high = -FLT_MAX;
+
+        for (unsigned bin = 0; bin < sortGroup->binCount; bin++)
+        {
+            const BatchQueue::BatchChunk* chunk = batchQ->_batchLists[sortGroup->binPositions[bin]].head.load(std::memory_order_relaxed);
+            for (; chunk; chunk = chunk->next)
+            {
+                unsigned chunkCount = chunk->getCount();
+                for (unsigned i = 0; i < chunkCount; i++)
+                {
+                    low = std::min(low, chunk->sortDepths[i]);
+                    high = std::max(high, chunk->sortDepths[i]);
+                }
+            }
+        }
+
+        depthMin = low;
+        inverseSpan = high > low ? 1.f / (high - low) : 0.f;
+    }
+
+    void RenderDispatch::SortJob::gather()
+    {
+        if (compact)
+            gatherRecords<BatchQueue::CompactSortBatch>();
+        else
+            gatherRecords<BatchQueue::SortBatch>();
     }
 
-    void RenderDispatch::SortJob::execute()
+    template<class Record> void RenderDispatch::SortJob::gatherRecords()
     {
+        typedef decltype(Record::sortKey) Key;      // compact records only ever hold depth keys
+
         assert(cachedSort.count > 0);
 
+        Record* records = (Record*)gathered;
+        setResult(records);
+        leader = nullptr;
+
         unsigned count = 0;
 
-        // Copy batches from slots into sort array
-        cachedSort.binMask.forEach(
-            [&](unsigned index, const RenderBin::Set&)
+        // Depth keys are made orderable as unsigned ints, and inverted for back-to-front
+
+        BatchStage::SortType sortType = sortGroup->sortType;
+        uint32_t depthKeyFlip = BatchStage::IsBackToFront(sortType) ? ~0u : 0u;
+
+        // Depth buckets take the top bits of the key and push the state key down, dropping its least significant bits.
+        // Buckets evenly divide the depth range of what was actually committed, so that's found first.
+
+        unsigned bucketCount = sortGroup->depthBuckets;
+        unsigned bucketBits = 0;
+        float depthMin = 0.f;
+        float bucketScale = 0.f;
+        if (sortType == BatchStage::SortType::DepthBucketedPerformance)
+        {
+            bucketBits = LocateBit(FloodBitsRight((uint32_t)bucketCount - 1) + 1);
+            findDepthRange(depthMin, bucketScale);
+            bucketScale *= (float)bucketCount;
+        }
+
+        // Copy batches from chunks into sort array, one column at a time
+
+        for (unsigned bin = 0; bin < sortGroup->binCount; bin++)
+        {
+            const BatchQueue::BatchChunk* chunk = batchQ->_batchLists[sortGroup->binPositions[bin]].head.load(std::memory_order_relaxed);
+            for (; chunk; chunk = chunk->next)
             {
-                BatchQueue::BatchListEntry* entry = batchQ->_batchLists[index].head;
-                for (; entry; entry = entry->next)
+                unsigned chunkCount = chunk->getCount();
+                assert(count + chunkCount <= cachedSort.count);
+
+                Record* out = records + count;
+                if (sortType == BatchStage::SortType::Performance)
                 {
-                    assert(count < cachedSort.count);
-                    if (sortType == BatchStage::SortType::Performance)
+                    for (unsigned i = 0; i < chunkCount; i++)
                     {
-                        cachedSort.batches[count].sortKey = entry->performanceSortKey;
+                        out[i].sortKey = (Key)chunk->performanceSortKeys[i];
                     }
-                    else
+                }
+                else if (sortType == BatchStage::SortType::DepthBucketedPerformance)
+                {
+                    for (unsigned i = 0; i < chunkCount; i++)
+                    {
+                        float slice = (chunk->sortDepths[i] - depthMin) * bucketScale;
+                        uint64_t bucket = slice < (float)bucketCount ? (unsigned)slice : bucketCount - 1;   // also catches NaN
+                        uint64_t stateKey = chunk->performanceSortKeys[i];
+                        out[i].sortKey = (Key)(bucketBits ? (bucket << (64 - bucketBits)) | (stateKey >> bucketBits) : stateKey);
+                    }
+                }
+                else
+                {
+                    for (unsigned i = 0; i < chunkCount; i++)
                     {
-                        cachedSort.batches[count].sortKey = 0;
-                        (float&)cachedSort.batches[count].sortKey = entry->sortDepth;
+                        out[i].sortKey = OrderableFromFloat(chunk->sortDepths[i]) ^ depthKeyFlip;
                     }
-                    //cachedSort.batches[count].batch = &item->batch;   TODO
-                    cachedSort.batches[count].batch = nullptr;
-                    count++;
                 }
+                for (unsigned i = 0; i < chunkCount; i++)
+                {
+                    out[i].setBatch(count + i, chunk->batches[i], batchTable);
+                }
+                count += chunkCount;
+            }
+        }
+
+        assert(count == cachedSort.count);
+    }
+
+    void RenderDispatch::SortJob::sort()
+    {
+        if (compact)
+            sortRecords<BatchQueue::CompactSortBatch>();
+        else
+            sortRecords<BatchQueue::SortBatch>();
+
+        if (history)
+        {
+            recordHistory();
+        }
+    }
+
+    template<class Record> void RenderDispatch::SortJob::sortRecords()
+    {
+        Record* records = (Record*)gathered;
+        unsigned count = cachedSort.count;
+
+        if (count <= InsertionSortMax)
+        {
+            InsertionSort(records, count);
+        }
+        else if (BatchStage::IsApproximate(sortGroup->sortType))
+        {
+            bucketSort<Record>();
+        }
+        else if (slots != nullptr)
+        {
+            seedFromHistory<Record>();
+            AdaptiveSort(records, (Record*)scratch, count);
+        }
+        else
+        {
+            RadixSort(records, (Record*)scratch, count);
+        }
+    }
+
+    template<class Record> void RenderDispatch::SortJob::bucketSort()
+    {
+        // Buckets evenly divide the depth range, since depth keys are far from linear in depth
+
+        Record* records = (Record*)gathered;
+        unsigned count = cachedSort.count;
+        unsigned bucketCount = sortGroup->depthBuckets;
+        uint32_t depthKeyFlip = BatchStage::IsBackToFront(sortGroup->sortType) ? ~0u : 0u;
+
+        uint64_t lowKey = records[0].sortKey;
+        uint64_t highKey = lowKey;
+        for (unsigned i = 1; i < count; i++)
+        {
+            lowKey = std::min(lowKey, (uint64_t)records[i].sortKey);
+            highKey = std::max(highKey, (uint64_t)records[i].sortKey);
+        }
+
+        // Back to front, first is the greater depth and the scale comes out negative
+
+        float first = FloatFromOrderable((uint32_t)lowKey ^ depthKeyFlip);
+        float last = FloatFromOrderable((uint32_t)highKey ^ depthKeyFlip);
+        float scale = last != first ? (float)bucketCount / (last - first) : 0.f;
+
+        BucketSort(records, (Record*)scratch, count, bucketCount,
+            [=](uint64_t key)
+            {
+                float slice = (FloatFromOrderable((uint32_t)key ^ depthKeyFlip) - first) * scale;
+                return slice < (float)bucketCount ? (unsigned)slice : bucketCount - 1;     // also catches NaN
             }
         );
+    }
+
+    template<class Record> void RenderDispatch::SortJob::seedFromHistory()
+    {
+        // Each batch goes back to its rank in last frame's order, and batches that are new this frame
+        // follow in commit order. Keys barely move between frames, so the result is almost sorted.
+
+        Record* records = (Record*)gathered;
+        Record* rankSlots = (Record*)slots;
+        unsigned previous = std::min(history->count, historyCount);
+
+        memset(ranks, 0, sizeof(HistoryRank) * (rankMask+1));
+        for (unsigned rank = 0; rank < previous; rank++)
+        {
+            const RenderBatch* batch = history->order[rank];
+            for (unsigned i = HashBatch(batch) & rankMask; ; i = (i+1) & rankMask)
+            {
+                if (ranks[i].batch == nullptr)
+                {
+                    ranks[i].batch = batch;
+                    ranks[i].rank = rank;
+                    break;
+                }
+                if (ranks[i].batch == batch)
+                {
+                    break;      // committed to more than one of the group's bins, first rank wins
+                }
+            }
+        }
+
+        memset(rankSlots, 0xff, sizeof(Record) * previous);
+
+        unsigned count = cachedSort.count;
+        unsigned newCount = 0;
+        for (unsigned n = 0; n < count; n++)
+        {
+            Record item = records[n];
+            const RenderBatch* batch = item.getBatch(batchTable);
+
+            Record* slot = nullptr;
+            for (unsigned i = HashBatch(batch) & rankMask; ranks[i].batch != nullptr; i = (i+1) & rankMask)
+            {
+                if (ranks[i].batch == batch)
+                {
+                    slot = rankSlots + ranks[i].rank;
+                    break;
+                }
+            }
+
+            if (slot != nullptr && slot->isVacant())
+            {
+                *slot = item;
+            }
+            else
+            {
+                records[newCount++] = item;     // never overtakes n
+            }
+        }
+
+        unsigned seeded = count - newCount;
+        memmove(records + seeded, records, sizeof(Record) * newCount);
+
+        unsigned placed = 0;
+        for (unsigned rank = 0; rank < previous; rank++)
+        {
+            if (!rankSlots[rank].isVacant())
+            {
+                records[placed++] = rankSlots[rank];
+            }
+        }
+        assert(placed == seeded);
+    }
+
+    void RenderDispatch::SortJob::recordHistory()
+    {
+        unsigned count = std::min(cachedSort.count, history->capacity);
+        for (unsigned i = 0; i < count; i++)
+        {
+            history->order[i] = cachedSort.getBatch(i);
+        }
+        history->count = count;
+    }
+
+    void RenderDispatch::SortJob::merge()
+    {
+        if (compact)
+            mergeRecords<BatchQueue::CompactSortBatch>();
+        else
+            mergeRecords<BatchQueue::SortBatch>();
+    }
+
+    template<class Record> void RenderDispatch::SortJob::mergeRecords()
+    {
+        // Runs of bins that were sorted the other way round are read back to front with their
+        // depth keys flipped, see gatherRecords(). Bucket sorted runs keep exact keys, so they merge
+        // with exact ones and only their own items stay out of order.
+
+        const RenderPlan::SortGroup* sortGroups = batchQ->_plan->getSortGroups();
+
+        SortedRun<Record> runs[MaxRenderBins];
+        RenderBatch* const* runBatchTables[MaxRenderBins];
+        unsigned runCount = 0;
+        unsigned count = 0;
+
+        for (unsigned i = 0; i < sortGroup->runCount; i++)
+        {
+            const BatchQueue::CachedSort* sorted = batchQ->_sortResults[sortGroup->runGroups[i]];
+            if (sorted == nullptr)
+            {
+                continue;   // bin is empty
+            }
+            assert((sorted->batchTable != nullptr) == compact);     // runs share the group's kind of key
+
+            runBatchTables[runCount] = sorted->batchTable;
+            SortedRun<Record>& run = runs[runCount++];
+            run.items = (const Record*)sorted->records;
+            run.count = sorted->count;
+            bool reversed = BatchStage::IsBackToFront(sortGroups[sortGroup->runGroups[i]].sortType) != BatchStage::IsBackToFront(sortGroup->sortType);
+            run.keyFlip = reversed ? 0xffffffffull : 0;
+            count += sorted->count;
+        }
 
         assert(count == cachedSort.count);
 
-        std::sort(cachedSort.batches, cachedSort.batches + count);
+        // Compact records are renumbered into this job's own batch table as they come out
+
+        Record* out = (Record*)gathered;
+        unsigned written = 0;
+        MergeSortedRuns(runs, runCount,
+            [&](Record item, unsigned run)
+            {
+                item.setBatch(written, item.getBatch(runBatchTables[run]), batchTable);
+                out[written++] = item;
+            }
+        );
+
+        setResult(out);
+        leader = nullptr;
     }
 
 }
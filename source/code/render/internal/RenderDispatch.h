@@ -2,6 +2,9 @@
 
 #include "core/memory.h"
 #include "core/math.h"
+#include "core/PodArray.h"
+#include "JobPool.h"
+#include "CommandStream.h"
 #include "../RenderBin.h"
 #include "../BatchQueue.h"  // TODO find better home for StageJob so this isn't needed
 
@@ -9,6 +12,7 @@ namespace eigen
 {
     class BatchQueue;
     class Renderer;
+    class Display;
     struct BatchStage;
 
     class RenderDispatch
@@ -16,14 +20,18 @@ namespace eigen
     public:
                                     struct Thread;
 
+        enum {                      MaxFramesInFlight = 3 };
+
                                     RenderDispatch(Renderer& renderer);
                                     ~RenderDispatch();
 
-        void                        initialize(Allocator* allocator, unsigned submissionThreads);
+        void                        initialize(Allocator* allocator, unsigned submissionThreads, unsigned framesInFlight, unsigned handoffSpinCount, bool inlineDispatch);
 
-        void                        sync();
-        void                        prepareWork(BatchQueue* head);
+        void                        sync();                             // waits until another frame may be kicked
+        bool                        trySync();                          // same, but gives up rather than wait
+        unsigned                    prepareWork(BatchQueue* head, Display* const* displays, unsigned displayCount, bool endsFrame);    // returns stage jobs
         void                        kick();
+        void                        waitForFrame(unsigned frameNumber); // waits until its last packet, already kicked, has been submitted
 
         void                        stop();
 
@@ -32,27 +40,71 @@ namespace eigen
     private:
                                     struct SortJob;
                                     struct StageJob;
+                                    struct SortHistory;
+                                    struct SortPart;
+                                    struct SubmitJob;
+                                    struct FrameWork;
 
         void                        asyncRun();
-        void                        addBatchQueueJobs(BatchQueue* batchQ, SortJob**& sortJobTail, StageJob*& stageJobEnd);
-        SortJob*                    createSortJob(BatchQueue* batchQ, unsigned count);
-        void                        submitStageJob(unsigned context, const StageJob& stageJob);
+        void                        runFrame(FrameWork& frame);
+        void                        attachSortHistories(FrameWork& frame);
+        bool                        addBatchQueueJobs(FrameWork& frame, BatchQueue* batchQ, unsigned occurrence, SortJob**& sortJobTail, StageJob*& stageJobEnd);
+        const BatchQueue::CachedSort* addSortJob(FrameWork& frame, BatchQueue* batchQ, unsigned group, unsigned occurrence, SortJob**& sortJobTail, unsigned& count);
+        SortJob*                    createSortJob(BatchQueue* batchQ, const RenderPlan::SortGroup* sortGroup, unsigned count, unsigned occurrence);
+        SortHistory*                findSortHistory(unsigned planSerial, unsigned group, unsigned occurrence, unsigned count);
+        void                        retireSortHistories(bool all);
+        void                        runSortJobs(FrameWork& frame, void (*run)(JobPool::Job*));
+        void                        runSortParts(SortPart* parts, unsigned partCount, void (*run)(JobPool::Job*));
+        template<class Record>
+        void                        parallelSort(SortJob* job);
+        void                        shareSortResults(FrameWork& frame);
+        void                        partitionStageJobs(FrameWork& frame);
+        void                        submitStageJobs(FrameWork& frame);
+        void                        recordStageJob(CommandWriter& writer, const StageJob& stageJob);
+        void                        replayCommands(unsigned context, const CommandStream& commands);
+        void                        executeContexts(unsigned contextCount);
 
         Renderer&                   _renderer;
+        Allocator*                  _allocator      = nullptr;
+
+        FrameWork*                  _frame          = nullptr;  // last prepared, handed to the dispatch thread by kick()
+        unsigned                    _contextCount   = 1;        // deferred contexts the backend made, or 1 for immediate only
+        bool                        _inline         = false;    // frames run on the calling thread in kick()
+        unsigned                    _frameNumber    = 0;    // frame being submitted, dispatch thread only
+
+        PodArray<SortHistory*>      _sortHistories;         // last order of each coherent sort group, dispatch thread only
 
-        BatchQueue*                 _head           = nullptr;
+        JobPool                     _jobPool;
 
-        SortJob*                    _sortJobHead    = nullptr;
-        StageJob*                   _stageJobs      = nullptr;
-        unsigned                    _stageJobCount  = 0;
+        void*                       _threadSpace[48];
+    };
+
+    // Everything the dispatch thread needs to submit and present one frame, built by prepareWork()
+    // in scratch memory. Stages dispatched early by Renderer::commenceFinishedStages() go in
+    // packets of their own ahead of the frame's last one, which have no displays to present.
+    // Only the last packet counts as the frame for waitForFrame().
 
-        void*                       _threadSpace[6];
+    struct RenderDispatch::FrameWork
+    {
+        unsigned                    frameNumber;
+        BatchQueue*                 head;
+        Display* const*             displays;           // to present once submitted
+        unsigned                    displayCount;
+        bool                        endsFrame;          // last packet of the frame, not an early one
+        SortJob*                    sortJobHead;
+        unsigned                    sortJobCount;
+        SortJob**                   sortShareTable;     // finds sort jobs with identical input
+        unsigned                    sortShareMask;
+        StageJob*                   stageJobs;
+        unsigned                    stageJobCount;
+        SubmitJob*                  submitJobs;         // one per context, each a run of stageJobs
+        unsigned                    submitJobCount;
     };
 
     struct RenderDispatch::StageJob
     {
         Stage*                      stage;
-        BatchQueue::SortBatch*      batches;
+        const BatchQueue::CachedSort* sorted;       // null for stages that draw no batches
         unsigned                    batchStart;
         unsigned                    batchEnd;
     };
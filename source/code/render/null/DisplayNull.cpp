@@ -0,0 +1,55 @@
+#include "DisplayNull.h"
+#include "RendererNull.h"
+#include "TextureNull.h"
+#include "core/memory.h"
+#include "core/Error.h"
+
+namespace eigen
+{
+    Error Display::bindToWindow(void* windowHandle)
+    {
+        DisplayNull* display = (DisplayNull*)this;
+
+        Renderer& renderer = ((DisplayNull*)this)->_renderer;
+
+        Renderer::PlatformDetails& plat = renderer.getPlatformDetails();
+
+        display->_window = windowHandle;    // may be null, there is nothing to draw into anyway
+        display->_target = renderer.createTexture();
+        ((TextureNull*)display->_target.ptr)->initAsDisplayTarget(plat.displayWidth, plat.displayHeight);
+
+        EIGEN_RETURN_OK();
+    }
+
+    void Display::present(unsigned frameNumber)
+    {
+        DisplayNull* display = (DisplayNull*)this;
+        Renderer& renderer = display->_renderer;
+
+        // Called on the dispatch thread after the frame's contexts are executed, so nothing else is using the immediate context
+
+        renderer.getPlatformDetails().immContext.record(NullCommand::Type::Present, frameNumber, display);
+    }
+
+    void DisplayManager::platformInit(Allocator* allocator)
+    {
+        _blockAllocator.initialize(allocator, sizeof(DisplayNull), 8);
+    }
+
+    Display* DisplayManager::createDisplay()
+    {
+        Renderer* renderer = StructFromMember(&Renderer::_displayManager, this);
+        DisplayNull* display = new(AllocateMemory<DisplayNull>(&_blockAllocator, 1)) DisplayNull(*renderer);
+
+        display->_index = _displays.getCount();
+        _displays.addLast() = display;
+
+        return display;
+    }
+
+    void DisplayManager::unregisterDisplay(Display* display)
+    {
+        _displays.remove(display->_index);
+    }
+
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+#include "../Display.h"
+
+namespace eigen
+{
+
+    class Renderer;
+
+    class DisplayNull :         public Display
+    {
+    public:
+                                DisplayNull(Renderer&);
+                                ~DisplayNull();
+
+        Renderer&               _renderer;
+        void*                   _window;
+    };
+
+    inline DisplayNull::DisplayNull(Renderer& renderer)
+        : _renderer(renderer)
+        , _window(nullptr)
+    {
+    }
+
+    inline DisplayNull::~DisplayNull()
+    {
+    }
+
+}
@@ -0,0 +1,27 @@
+#include "RendererNull.h"
+#include "RenderBufferNull.h"
+
+namespace eigen
+{
+
+    Error RenderBuffer::platformInit(const Config& config)
+    {
+        if (config.elementStride * config.elementCount == 0)
+        {
+            EIGEN_RETURN_ERROR("Failed to create buffer, size = %d", (long)(config.elementStride * config.elementCount));
+        }
+
+        Renderer::PlatformDetails& plat = ((RenderBufferNull*)this)->_renderer.getPlatformDetails();
+        plat.bufferInits.fetch_add(1, std::memory_order_relaxed);
+
+        ((RenderBufferNull*)this)->_allocated = true;
+
+        EIGEN_RETURN_OK();
+    }
+
+    void RenderBuffer::platformDetach()
+    {
+        ((RenderBufferNull*)this)->_allocated = false;
+    }
+
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+#include "../RenderBuffer.h"
+
+namespace eigen
+{
+
+    class Renderer;
+
+    class RenderBufferNull :    public RenderBuffer
+    {
+    public:
+                                RenderBufferNull(Renderer&);
+                                ~RenderBufferNull();
+
+        Renderer&               _renderer;
+        bool                    _allocated;
+    };
+
+    inline RenderBufferNull::RenderBufferNull(Renderer& renderer)
+        : _renderer(renderer)
+        , _allocated(false)
+    {
+    }
+
+    inline RenderBufferNull::~RenderBufferNull()
+    {
+    }
+
+}
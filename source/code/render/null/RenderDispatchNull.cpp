@@ -0,0 +1,68 @@
+#include "../internal/RenderDispatch.h"
+#include "RendererNull.h"
+#include "TargetSetNull.h"
+
+namespace eigen
+{
+
+    void RenderDispatch::replayCommands(unsigned context, const CommandStream& commands)
+    {
+        Renderer::PlatformDetails& plat = _renderer.getPlatformDetails();
+
+        NullContext& ctx = plat.deferredContextCount ? plat.deferredContexts[context] : plat.immContext;
+
+        for (const CommandStream::Command* command = commands.begin; command != commands.end; command = command->next())
+        {
+            const void* const* operands = command->getOperands();
+
+            switch (command->op)
+            {
+
+            case CommandStream::Op::Clear:
+            {
+                const ClearStage* clearStage = (const ClearStage*)operands[0];
+                const TargetSetNull* targets = (TargetSetNull*)clearStage->targets;
+
+                if (Any(clearStage->flags & ClearStage::Flags::Depth_Stencil) && targets->_hasDepthStencil)
+                {
+                    ctx.record(NullCommand::Type::ClearDepthStencil, _frameNumber, targets);
+                }
+
+                for (unsigned i = 0; i < targets->getTextureCount(); i++)
+                {
+                    ctx.record(NullCommand::Type::ClearTarget, _frameNumber, targets);
+                }
+                break;
+            }
+
+            case CommandStream::Op::SetTargets:
+
+                ctx.record(NullCommand::Type::SetTargets, _frameNumber, operands[0]);
+                break;
+
+            case CommandStream::Op::Draw:
+
+                for (unsigned i = 0; i < command->count; i++)
+                {
+                    ctx.record(NullCommand::Type::Draw, _frameNumber, operands[i]);
+                }
+                break;
+
+            case CommandStream::Op::Filter:
+
+                break;
+            }
+        }
+    }
+
+    void RenderDispatch::executeContexts(unsigned contextCount)
+    {
+        Renderer::PlatformDetails& plat = _renderer.getPlatformDetails();
+
+        for (unsigned i = 0; i < contextCount; i++)
+        {
+            plat.immContext.execute(plat.deferredContexts[i], _frameNumber);
+        }
+    }
+
+}
@@ -0,0 +1,106 @@
+#include "RendererNull.h"
+#include "DisplayNull.h"
+#include "TextureNull.h"
+#include "RenderBufferNull.h"
+#include "TargetSetNull.h"
+#include <cassert>
+#include <new>
+
+namespace eigen
+{
+    Error Renderer::platformInit(const Config& config)
+    {
+        static_assert(sizeof(PlatformDetails) <= sizeof(Renderer::_platformDetails), "Must increase size of Renderer::_platformDetails");
+
+        _displayManager.initialize(config.allocator);
+        _textureAllocator.initialize(config.allocator, sizeof(TextureNull), 64);
+        _bufferAllocator.initialize(config.allocator, sizeof(RenderBufferNull), 64);
+        _targetSetAllocator.initialize(config.allocator, sizeof(TargetSetNull), 16);
+
+        PlatformConfig defaults;
+        const PlatformConfig& platConfig = config.platformConfig ? *config.platformConfig : defaults;
+
+        PlatformDetails& plat = getPlatformDetails();
+        new (&plat) PlatformDetails();
+        plat.displayWidth = platConfig.displayWidth;
+        plat.displayHeight = platConfig.displayHeight;
+        plat.textureInits.store(0, std::memory_order_relaxed);
+        plat.bufferInits.store(0, std::memory_order_relaxed);
+        plat.targetSetInits.store(0, std::memory_order_relaxed);
+
+        plat.immContext.initialize(config.allocator, platConfig.commandCapacity);
+
+        // Create deferred contexts if num threads > 1
+        if (config.submissionThreads > 1)
+        {
+            plat.deferredContextCount = config.submissionThreads;
+
+            plat.deferredContexts = AllocateMemory<NullContext>(config.allocator, config.submissionThreads);
+            for (unsigned i = 0; i < config.submissionThreads; i++)
+            {
+                new (plat.deferredContexts+i) NullContext();
+                plat.deferredContexts[i].initialize(config.allocator, platConfig.commandCapacity);
+            }
+        }
+
+        EIGEN_RETURN_OK();
+    }
+
+    void Renderer::platformCleanup()
+    {
+        PlatformDetails& plat = getPlatformDetails();
+
+        for (unsigned i = 0; i < plat.deferredContextCount; i++)
+        {
+            plat.deferredContexts[i].cleanup();
+        }
+        FreeMemory(plat.deferredContexts);
+
+        plat.immContext.cleanup();
+        plat.~PlatformDetails();
+    }
+
+    TexturePtr Renderer::createTexture()
+    {
+        TextureNull* texture = new(AllocateMemory<TextureNull>(&_textureAllocator, 1)) TextureNull(*this);
+        return texture;
+    }
+
+    RenderBufferPtr Renderer::createBuffer()
+    {
+        RenderBufferNull* buffer = new(AllocateMemory<RenderBufferNull>(&_bufferAllocator, 1)) RenderBufferNull(*this);
+        return buffer;
+    }
+
+    TargetSetPtr Renderer::createTargetSet()
+    {
+        TargetSetNull* targetSet = new(AllocateMemory<TargetSetNull>(&_targetSetAllocator, 1)) TargetSetNull(*this);
+        return targetSet;
+    }
+
+    void DestroyRefCounted(Display* display)
+    {
+        Renderer& renderer = ((DisplayNull*)display)->_renderer;
+        renderer._displayManager.unregisterDisplay(display);
+        renderer.scheduleDeletion((DisplayNull*)display, 1);
+    }
+
+    void DestroyRefCounted(Texture* texture)
+    {
+        Renderer& renderer = ((TextureNull*)texture)->_renderer;
+        renderer.scheduleDeletion((TextureNull*)texture, 1);
+    }
+
+    void DestroyRefCounted(RenderBuffer* buffer)
+    {
+        Renderer& renderer = ((RenderBufferNull*)buffer)->_renderer;
+        renderer.scheduleDeletion((RenderBufferNull*)buffer, 1);
+    }
+
+    void DestroyRefCounted(TargetSet* targetSet)
+    {
+        Renderer& renderer = ((TargetSetNull*)targetSet)->_renderer;
+        renderer.scheduleDeletion((TargetSetNull*)targetSet, 1);
+    }
+
+}
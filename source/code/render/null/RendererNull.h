@@ -0,0 +1,140 @@
+#pragma once
+
+#include "../Renderer.h"
+#include <atomic>
+
+namespace eigen
+{
+
+    ///////////////////////////////////////////////////////////////////////////////////////////
+    //
+    // NullCommand
+    //
+    // What the null backend would have asked of the GPU
+    //
+
+    struct NullCommand
+    {
+        enum class Type         : uint8_t
+        {
+            ClearDepthStencil   = 0,
+            ClearTarget,
+            SetTargets,
+            Draw,
+            Present,
+            ExecuteCommands,                    // followed by the deferred context's commands it replays
+        };
+
+        Type                    type;
+        unsigned                frameNumber;
+        const void*             object;         // TargetSet, RenderBatch, Display or NullContext
+    };
+
+    ///////////////////////////////////////////////////////////////////////////////////////////
+    //
+    // NullContext
+    //
+    // Ring buffer of the most recent commands issued to a context (stands in for ID3D11DeviceContext).
+    // Executing a deferred context copies its new commands into the immediate one, so the immediate
+    // context holds the whole stream in the order the GPU would see it.
+    //
+
+    struct NullContext
+    {
+        void                    initialize(Allocator* allocator, unsigned capacity);
+        void                    cleanup();
+
+        void                    record(NullCommand::Type type, unsigned frameNumber, const void* object);
+        void                    execute(NullContext& deferred, unsigned frameNumber);
+
+        unsigned                getRetainedCount() const;
+        const NullCommand&      getRetained(unsigned i) const;      // 0 is oldest retained
+
+        NullCommand*            commands    = nullptr;
+        unsigned                capacity    = 0;
+        unsigned                count       = 0;                    // total ever recorded
+        unsigned                executed    = 0;                    // deferred only: count when last executed
+    };
+
+    struct Renderer::PlatformConfig
+    {
+        unsigned                        commandCapacity = 64*1024;  // per context, 0 to only count
+        uint16_t                        displayWidth    = 1280;
+        uint16_t                        displayHeight   = 720;
+    };
+
+    struct Renderer::PlatformDetails
+    {
+        NullContext                     immContext;
+        NullContext*                    deferredContexts        = nullptr;
+        unsigned                        deferredContextCount    = 0;
+        uint16_t                        displayWidth            = 0;
+        uint16_t                        displayHeight           = 0;
+        std::atomic<unsigned>           textureInits;
+        std::atomic<unsigned>           bufferInits;
+        std::atomic<unsigned>           targetSetInits;
+    };
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+    ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+    inline Renderer::PlatformDetails& Renderer::getPlatformDetails()
+    {
+        return (PlatformDetails&)_platformDetails;
+    }
+
+    inline void NullContext::initialize(Allocator* allocator, unsigned capacity_)
+    {
+        assert(commands == nullptr);    // already initialized
+        capacity = capacity_ ? FloodBitsRight((uint32_t)capacity_ - 1) + 1 : 0;   // pow2 for masking
+        commands = capacity ? AllocateMemory<NullCommand>(allocator, capacity) : nullptr;
+        count = 0;
+        executed = 0;
+    }
+
+    inline void NullContext::cleanup()
+    {
+        FreeMemory(commands);
+        commands = nullptr;
+        capacity = 0;
+    }
+
+    inline void NullContext::record(NullCommand::Type type, unsigned frameNumber, const void* object)
+    {
+        if (capacity)
+        {
+            NullCommand& command = commands[count & (capacity-1)];
+            command.type        = type;
+            command.frameNumber = frameNumber;
+            command.object      = object;
+        }
+        count++;
+    }
+
+    inline void NullContext::execute(NullContext& deferred, unsigned frameNumber)
+    {
+        record(NullCommand::Type::ExecuteCommands, frameNumber, &deferred);
+
+        // Commands the deferred ring has already overwritten are lost, as is everything if it only counts
+
+        unsigned first = deferred.count - std::min(deferred.count - deferred.executed, deferred.getRetainedCount());
+        for (unsigned i = first; i != deferred.count; i++)
+        {
+            const NullCommand& command = deferred.commands[i & (deferred.capacity-1)];
+            record(command.type, command.frameNumber, command.object);
+        }
+        deferred.executed = deferred.count;
+    }
+
+    inline unsigned NullContext::getRetainedCount() const
+    {
+        return count < capacity ? count : capacity;
+    }
+
+    inline const NullCommand& NullContext::getRetained(unsigned i) const
+    {
+        assert(i < getRetainedCount());
+        return commands[(count - getRetainedCount() + i) & (capacity-1)];
+    }
+
+}
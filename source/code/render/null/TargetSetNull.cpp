@@ -0,0 +1,39 @@
+#include "TargetSetNull.h"
+#include "RendererNull.h"
+
+namespace eigen
+{
+
+    Error TargetSet::platformInit(const Config& config)
+    {
+        Renderer& renderer = ((TargetSetNull*)this)->_renderer;
+        auto plat = (TargetSetNull*)this;
+
+        if (config.zbuffer)
+        {
+            if (!IsDepthFormat(config.zbuffer->getConfig().format))
+            {
+                EIGEN_RETURN_ERROR("Failed to create DepthStencilView, format = %d", (long)config.zbuffer->getConfig().format);
+            }
+            plat->_hasDepthStencil = true;
+        }
+        for (unsigned i = 0; i < _textureCount; i++)
+        {
+            if (!((TextureNull*)config.textures[i])->_allocated)
+            {
+                EIGEN_RETURN_ERROR("Failed to create RenderTargetView for texture %d", (long)i);
+            }
+        }
+
+        renderer.getPlatformDetails().targetSetInits.fetch_add(1, std::memory_order_relaxed);
+
+        EIGEN_RETURN_OK();
+    }
+
+    void TargetSet::platformDetach()
+    {
+        auto plat = (TargetSetNull*)this;
+        plat->_hasDepthStencil = false;
+    }
+
+}
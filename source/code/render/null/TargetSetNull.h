@@ -0,0 +1,29 @@
+#pragma once
+
+#include "../TargetSet.h"
+#include "TextureNull.h"
+
+namespace eigen
+{
+
+    class TargetSetNull :               public TargetSet
+    {
+    public:
+                                        TargetSetNull(Renderer& renderer);
+                                        ~TargetSetNull();
+
+        Renderer&                       _renderer;
+        bool                            _hasDepthStencil;
+    };
+
+    inline TargetSetNull::TargetSetNull(Renderer& renderer)
+        : _renderer(renderer)
+        , _hasDepthStencil(false)
+    {
+    }
+
+    inline TargetSetNull::~TargetSetNull()
+    {
+    }
+
+}
@@ -0,0 +1,43 @@
+#include "RendererNull.h"
+#include "TextureNull.h"
+
+namespace eigen
+{
+
+    Error Texture::platformInit(const Config& config)
+    {
+        if (config.width == 0)
+        {
+            EIGEN_RETURN_ERROR("Failed to create texture, width = %d", (long)config.width);
+        }
+        if (config.format == Format::Unspecified)
+        {
+            EIGEN_RETURN_ERROR("Failed to create texture, format = %d", (long)config.format);
+        }
+
+        Renderer::PlatformDetails& plat = ((TextureNull*)this)->_renderer.getPlatformDetails();
+        plat.textureInits.fetch_add(1, std::memory_order_relaxed);
+
+        ((TextureNull*)this)->_allocated = true;
+
+        EIGEN_RETURN_OK();
+    }
+
+    void Texture::platformDetach()
+    {
+        ((TextureNull*)this)->_allocated = false;
+    }
+
+    void TextureNull::initAsDisplayTarget(uint16_t width, uint16_t height)
+    {
+        _config = Config();
+        _config.format          = Format::RGB10_A2;
+        _config.usage           = Usage::RenderTarget;
+        _config.width           = width;
+        _config.height          = height;
+        _config.arrayLength     = 1;
+
+        _allocated = true;
+    }
+
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include "../Texture.h"
+
+namespace eigen
+{
+
+    class Renderer;
+
+    class TextureNull :         public Texture
+    {
+    public:
+                                TextureNull(Renderer&);
+                                ~TextureNull();
+
+        void                    initAsDisplayTarget(uint16_t width, uint16_t height);
+
+        Renderer&               _renderer;
+        bool                    _allocated;
+    };
+
+    inline TextureNull::TextureNull(Renderer& renderer)
+        : _renderer(renderer)
+        , _allocated(false)
+    {
+    }
+
+    inline TextureNull::~TextureNull()
+    {
+    }
+
+}
@@ -0,0 +1,245 @@
+// Runs plans through the null backend and checks what it recorded: every batch drawn once per stage,
+// stages in plan order, each stage in its sort order, and one present per frame.
+// Returns nonzero on failure.
+
+#include "render/BatchQueue.h"
+#include "render/RenderPlan.h"
+#include "render/null/RendererNull.h"
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+
+using namespace eigen;
+
+namespace
+{
+    enum
+    {
+        BinCount        = 3,                    // increasing depth, decreasing depth, performance
+        BatchesPerBin   = 4000,                 // enough work for several deferred contexts
+        BatchCount      = BinCount * BatchesPerBin,
+        FramesPerRun    = 5,
+    };
+
+    class TestBatch : public RenderBatch
+    {
+    public:
+
+        TestBatch(unsigned seed)
+        {
+            _stateIds[PerformanceKeyLayout::Effect]             = seed % 7;
+            _stateIds[PerformanceKeyLayout::Aspects]            = seed % 3;
+            _stateIds[PerformanceKeyLayout::Data]               = seed % 101;
+            _stateIds[PerformanceKeyLayout::ParameterBlocks]    = seed;
+        }
+    };
+
+    // RenderBatch can't be destroyed from outside, so batches live in static storage and are never destroyed
+
+    alignas(TestBatch) uint8_t  s_batchMemory[BatchCount * sizeof(TestBatch)];
+    TestBatch*                  s_batches   = (TestBatch*)s_batchMemory;
+    RenderBatch*                s_pointers[BatchCount];
+    const RenderBin*            s_bins[BatchCount];
+    float                       s_depths[BatchCount];
+
+    unsigned                    s_failures  = 0;
+
+    void Check(bool condition, const char* what, const char* run, unsigned frameNumber)
+    {
+        if (!condition)
+        {
+            printf("FAILED %s: %s, frame %u\n", run, what, frameNumber);
+            s_failures++;
+        }
+    }
+
+    void InitializeBatches(RenderBin* const* bins)
+    {
+        srand(1);
+
+        for (unsigned i = 0; i < BatchCount; i++)
+        {
+            s_pointers[i] = new (s_batches + i) TestBatch(rand());
+            s_bins[i] = bins[i / BatchesPerBin];
+            s_depths[i] = rand() / (float)RAND_MAX;
+        }
+    }
+
+    // Scans the frame's commands in the immediate context, which holds deferred contexts' commands as executed
+
+    void CheckFrame(const NullContext& context, const PerformanceKeyLayout& layout, const char* run, unsigned frameNumber)
+    {
+        unsigned draws[BinCount] = {};
+        unsigned presents = 0;
+        unsigned lastBin = 0;
+        bool drawAfterPresent = false;
+        bool binsInOrder = true;
+        bool sorted[BinCount] = {true, true, true};
+        const TestBatch* previous = nullptr;
+
+        for (unsigned i = 0; i < context.getRetainedCount(); i++)
+        {
+            const NullCommand& command = context.getRetained(i);
+            if (command.frameNumber != frameNumber)
+            {
+                continue;
+            }
+
+            if (command.type == NullCommand::Type::Present)
+            {
+                presents++;
+            }
+            else if (command.type == NullCommand::Type::Draw)
+            {
+                const TestBatch* batch = (const TestBatch*)command.object;
+                unsigned bin = (unsigned)(batch - s_batches) / BatchesPerBin;
+
+                drawAfterPresent |= presents > 0;
+                binsInOrder &= bin >= lastBin;
+
+                if (previous && bin == lastBin)
+                {
+                    float depth = s_depths[batch - s_batches];
+                    float previousDepth = s_depths[previous - s_batches];
+
+                    switch (bin)
+                    {
+                    case 0: sorted[0] &= depth >= previousDepth; break;
+                    case 1: sorted[1] &= depth <= previousDepth; break;
+                    case 2: sorted[2] &= layout.build(batch->getStateIds()) >= layout.build(previous->getStateIds()); break;
+                    }
+                }
+
+                draws[bin]++;
+                lastBin = bin;
+                previous = batch;
+            }
+        }
+
+        for (unsigned bin = 0; bin < BinCount; bin++)
+        {
+            Check(draws[bin] == BatchesPerBin, "every batch drawn once", run, frameNumber);
+        }
+        Check(binsInOrder, "stages drawn in plan order", run, frameNumber);
+        Check(sorted[0], "increasing depth order", run, frameNumber);
+        Check(sorted[1], "decreasing depth order", run, frameNumber);
+        Check(sorted[2], "performance order", run, frameNumber);
+        Check(presents == 1, "one present", run, frameNumber);
+        Check(!drawAfterPresent, "present after draws", run, frameNumber);
+    }
+
+    void Run(const char* run, unsigned submissionThreads, unsigned framesInFlight, bool inlineDispatch, bool finishEarly)
+    {
+        Renderer::PlatformConfig platformConfig;
+        platformConfig.commandCapacity = 256*1024;
+
+        Renderer::Config config;
+        config.scratchSize = 16*1024*1024;
+        config.submissionThreads = submissionThreads;
+        config.framesInFlight = framesInFlight;
+        config.scratchFrames = framesInFlight + 1;
+        config.inlineDispatch = inlineDispatch;
+        config.platformConfig = &platformConfig;
+
+        Renderer renderer;
+        Error error = renderer.initialize(config);
+        if (Failed(error))
+        {
+            printf("FAILED %s: %s\n", run, error.getText());
+            s_failures++;
+            return;
+        }
+
+        {
+            RenderBin* bins[BinCount] = {renderer.getBin("increasing"), renderer.getBin("decreasing"), renderer.getBin("performance")};
+            InitializeBatches(bins);
+
+            DisplayPtr display = renderer.createDisplay();
+            display.ptr->bindToWindow((void*)1);
+
+            TargetSetPtr targets = renderer.createTargetSet();
+            TargetSet::Config targetsConfig;
+            targetsConfig.textures[0] = display.ptr->getTarget();
+            targets.ptr->initialize(targetsConfig);
+
+            RenderPlanPtr plan = renderer.createPlan();
+            plan.ptr->addClearStage(targets.ptr);
+
+            const BatchStage::SortType sortTypes[BinCount] =
+            {
+                BatchStage::SortType::IncreasingDepth,
+                BatchStage::SortType::DecreasingDepth,
+                BatchStage::SortType::Performance,
+            };
+            for (unsigned i = 0; i < BinCount; i++)
+            {
+                BatchStage& stage = plan.ptr->addBatchStage(targets.ptr);
+                stage.sortType = sortTypes[i];
+                stage.attachBin(bins[i]);
+            }
+
+            error = plan.ptr->validate();
+            Check(!Failed(error), "plan validates", run, 0);
+
+            unsigned firstFrame = renderer.getFrameNumber();
+
+            for (unsigned f = 0; f < FramesPerRun; f++)
+            {
+                BatchQueue* batchQ = renderer.openBatchQueue(plan.ptr);
+                Check(batchQ != nullptr, "queue opened", run, renderer.getFrameNumber());
+                if (!batchQ)
+                {
+                    break;
+                }
+
+                // The first bin one batch at a time, the rest in bulk
+
+                for (unsigned i = 0; i < BatchesPerBin; i++)
+                {
+                    batchQ->commitBatch(s_pointers[i], s_bins[i], s_depths[i]);
+                }
+
+                if (finishEarly)
+                {
+                    batchQ->finishBins(bins[0]->getBit());
+                    Check(!Failed(renderer.commenceFinishedStages()), "early stages commenced", run, renderer.getFrameNumber());
+                }
+
+                batchQ->commitBatches(s_pointers + BatchesPerBin, s_bins + BatchesPerBin, s_depths + BatchesPerBin, BatchCount - BatchesPerBin);
+                batchQ->finish();
+
+                Check(!Failed(renderer.commenceWork()), "work commenced", run, renderer.getFrameNumber());
+            }
+
+            unsigned lastFrame = renderer.getFrameNumber() - 1;
+            renderer.waitForFrame(lastFrame);
+
+            for (unsigned frameNumber = firstFrame; frameNumber <= lastFrame; frameNumber++)
+            {
+                CheckFrame(renderer.getPlatformDetails().immContext, plan.ptr->getPerformanceKeyLayout(), run, frameNumber);
+            }
+        }
+
+        renderer.cleanup();
+    }
+}
+
+int main()
+{
+    Run("1 thread, 1 frame in flight",      1, 1, false, false);
+    Run("1 thread, 3 frames in flight",     1, 3, false, false);
+    Run("4 threads, 1 frame in flight",     4, 1, false, false);
+    Run("4 threads, 3 frames in flight",    4, 3, false, false);
+    Run("4 threads, early stages",          4, 3, false, true);
+    Run("inline dispatch",                  1, 1, true,  false);
+    Run("inline dispatch, early stages",    1, 1, true,  true);
+
+    if (s_failures)
+    {
+        printf("%u checks failed\n", s_failures);
+        return 1;
+    }
+
+    puts("ok");
+    return 0;
+}